@@ -0,0 +1,177 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "accesslog.h"
+
+/* Records the ring holds; the writer is woken early when half are used */
+#define LOG_RING 4096
+
+/* Longest filename kept in a record; longer ones are cut short */
+#define LOG_NAME 128
+
+/* Slots in the writer's hostname cache, and how long an answer is good */
+#define DNS_SLOTS 256
+#define DNS_TTL   300
+
+struct record {
+    struct timespec when;
+    in_addr_t       addr;
+    int             type;           /* an enum req_type, or -1 */
+    int             ok;
+    size_t          bytes;
+    uint64_t        us;
+    char            name[LOG_NAME];
+};
+
+struct host {
+    in_addr_t addr;
+    time_t    expires;              /* 0 for an empty slot */
+    char      name[NI_MAXHOST];
+};
+
+static const char *type_names[REQ_NTYPES] = {
+    "GET", "PUT", "MGET", "SUM", "COMMIT", "LINK", "STATS"
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    struct record  *ring;
+    size_t          head;           /* oldest record */
+    size_t          count;
+    unsigned long   dropped;
+    FILE           *out;
+    int             resolve;
+    struct host    *hosts;          /* only the writer touches these */
+    struct record  *batch;
+} alog = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*
+ * client_name() - how to show a client: its hostname if we are resolving
+ *                 and it has one, else its address
+ */
+static const char *client_name(in_addr_t addr, char *numeric) {
+    struct in_addr in = { .s_addr = addr };
+    inet_ntop(AF_INET, &in, numeric, INET_ADDRSTRLEN);
+    if (!alog.resolve)
+        return numeric;
+
+    struct host *h = &alog.hosts[(addr ^ addr >> 16) % DNS_SLOTS];
+    time_t now = time(NULL);
+    if (h->expires && h->addr == addr && now < h->expires)
+        return h->name;
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr = in };
+    if (getnameinfo((struct sockaddr *)&sa, sizeof(sa), h->name,
+                    sizeof(h->name), NULL, 0, NI_NAMEREQD) != 0)
+        strcpy(h->name, numeric);   /* remember failures too */
+    h->addr = addr;
+    h->expires = now + DNS_TTL;
+    return h->name;
+}
+
+/*
+ * write_record() - format one record as a line of the log
+ */
+static void write_record(const struct record *r) {
+    char when[32], numeric[INET_ADDRSTRLEN];
+    struct tm tm;
+    gmtime_r(&r->when.tv_sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(alog.out, "%s.%03ldZ %s %s %s %s %zu %lu\n", when,
+            r->when.tv_nsec / 1000000, client_name(r->addr, numeric),
+            r->type < 0 ? "-" : type_names[r->type],
+            r->name[0] ? r->name : "-", r->ok ? "OK" : "ERROR", r->bytes,
+            (unsigned long)r->us);
+}
+
+/*
+ * writer() - drain the ring into the log, about once a second
+ */
+static void *writer(void *arg) {
+    struct record *batch = alog.batch;
+    pthread_mutex_lock(&alog.lock);
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        while (alog.count < LOG_RING / 2 &&
+               pthread_cond_timedwait(&alog.wake, &alog.lock, &deadline) == 0)
+            ;
+
+        /* copy the records out, so the handlers can go on adding more while
+           these are written */
+        size_t n = alog.count;
+        for (size_t i = 0; i < n; i++)
+            batch[i] = alog.ring[(alog.head + i) % LOG_RING];
+        alog.head = (alog.head + n) % LOG_RING;
+        alog.count = 0;
+        unsigned long dropped = alog.dropped;
+        alog.dropped = 0;
+        pthread_mutex_unlock(&alog.lock);
+
+        for (size_t i = 0; i < n; i++)
+            write_record(&batch[i]);
+        if (dropped)
+            fprintf(alog.out, "access log dropped %lu records\n", dropped);
+        if (n || dropped)
+            fflush(alog.out);
+        pthread_mutex_lock(&alog.lock);
+    }
+    return NULL;
+}
+
+int accesslog_open(const char *path, int resolve) {
+    alog.out = strcmp(path, "-") == 0 ? stdout : fopen(path, "a");
+    if (alog.out == NULL)
+        return -1;
+    alog.resolve = resolve;
+    alog.ring = calloc(LOG_RING, sizeof(*alog.ring));
+    alog.batch = calloc(LOG_RING, sizeof(*alog.batch));
+    if (resolve)
+        alog.hosts = calloc(DNS_SLOTS, sizeof(*alog.hosts));
+    if (alog.ring == NULL || alog.batch == NULL ||
+        (resolve && alog.hosts == NULL)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, writer, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+void accesslog_request(const struct sockaddr_in *peer,
+                       const struct request *req, int ok, size_t bytes,
+                       uint64_t ns) {
+    if (alog.ring == NULL)
+        return;
+    struct record r = {
+        .addr = peer->sin_addr.s_addr, .type = req ? (int)req->type : -1,
+        .ok = ok, .bytes = bytes, .us = ns / 1000
+    };
+    clock_gettime(CLOCK_REALTIME, &r.when);
+    /* an MGET's names are one per line; log the first */
+    if (req && req->filename)
+        snprintf(r.name, sizeof(r.name), "%.*s",
+                 (int)strcspn(req->filename, "\n"), req->filename);
+
+    pthread_mutex_lock(&alog.lock);
+    if (alog.count == LOG_RING)
+        alog.dropped++;
+    else {
+        alog.ring[(alog.head + alog.count++) % LOG_RING] = r;
+        if (alog.count == LOG_RING / 2)
+            pthread_cond_signal(&alog.wake);
+    }
+    pthread_mutex_unlock(&alog.lock);
+}
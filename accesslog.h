@@ -0,0 +1,42 @@
+#ifndef ACCESSLOG_H__
+#define ACCESSLOG_H__
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "request.h"
+
+/*
+ * A buffered access log, written by a thread of its own so that logging
+ * never waits on the disk or on DNS.  Connection handlers drop a small
+ * record per request into a bounded in-memory ring and carry on; the
+ * writer drains the ring about once a second, or sooner when it fills up,
+ * and formats each record as one line:
+ *
+ *   <time> <client> <type> <name> <status> <bytes> <microseconds>
+ *
+ * Clients are logged by numeric address unless hostnames were asked for,
+ * in which case the writer looks them up, keeping answers (and failures)
+ * for a while so that a busy client costs one lookup, not one per request.
+ * If the ring is full, records are dropped and counted rather than making
+ * a request wait, and the count is logged once there is room again.
+ */
+
+/*
+ * accesslog_open() - start logging to path ("-" for standard output),
+ *                    looking up client hostnames if resolve is set.
+ *                    Returns 0, or -1 if the log can't be opened.
+ */
+int accesslog_open(const char *path, int resolve);
+
+/*
+ * accesslog_request() - log one request from the client at peer.  req is
+ *                       NULL if the request could not be parsed; ok is
+ *                       whether it succeeded; bytes is how much body it
+ *                       moved, and ns how long it took.
+ */
+void accesslog_request(const struct sockaddr_in *peer,
+                       const struct request *req, int ok, size_t bytes,
+                       uint64_t ns);
+
+#endif
@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "aio.h"
+
+/* A FIFO of operations, linked through next */
+struct queue {
+    struct aio_op *head;
+    struct aio_op *tail;
+};
+
+struct aio {
+    enum aio_engine engine;
+    int             efd;            /* eventfd that completions tick */
+    unsigned        inflight;       /* AIO_URING: submitted, not reaped */
+    struct queue    waiting;        /* AIO_URING: not yet submitted */
+
+    /* AIO_URING: the rings shared with the kernel */
+    int                  ring;
+    unsigned             entries;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned             queued;    /* SQEs written since the last enter */
+
+    /* AIO_POOL, and AIO_CALL for either: work for the threads, and what
+       they have finished */
+    int             threads;        /* whether they have been started */
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    struct queue    todo;
+    struct queue    finished;
+};
+
+static const char *engine_names[AIO_NENGINES] = { "none", "uring", "threads" };
+
+static void push(struct queue *q, struct aio_op *op) {
+    op->next = NULL;
+    if (q->tail)
+        q->tail->next = op;
+    else
+        q->head = op;
+    q->tail = op;
+}
+
+static struct aio_op *pop(struct queue *q) {
+    struct aio_op *op = q->head;
+    if (op && (q->head = op->next) == NULL)
+        q->tail = NULL;
+    return op;
+}
+
+int aio_engine_parse(const char *name) {
+    for (int i = 0; i < AIO_NENGINES; i++)
+        if (strcmp(name, engine_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+/*
+ * uring_supports() - whether the kernel's io_uring has every opcode we use
+ */
+static int uring_supports(int ring) {
+    static const int needed[] = {
+        IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC
+    };
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = probe && syscall(__NR_io_uring_register, ring,
+                              IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++)
+        ok = needed[i] <= probe->last_op &&
+             (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+/*
+ * uring_open() - set up an io_uring whose completions tick a->efd.
+ *                Returns 0, or -1 if io_uring can't be had.
+ */
+static int uring_open(struct aio *a) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if ((a->ring = syscall(__NR_io_uring_setup, AIO_DEPTH, &p)) < 0)
+        return -1;
+    if (!uring_supports(a->ring) ||
+        syscall(__NR_io_uring_register, a->ring, IORING_REGISTER_EVENTFD,
+                &a->efd, 1) < 0)
+        goto fail;
+
+    /* the rings share one mapping where the kernel allows */
+    size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cqsize > sqsize)
+        sqsize = cqsize;
+    size_t sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+    char *sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, a->ring, IORING_OFF_SQ_RING);
+    char *cq = single ? sq
+                      : mmap(NULL, cqsize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, a->ring,
+                             IORING_OFF_CQ_RING);
+    a->sqes = mmap(NULL, sqesize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, a->ring, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || a->sqes == MAP_FAILED) {
+        if (sq != MAP_FAILED)
+            munmap(sq, sqsize);
+        if (cq != MAP_FAILED && !single)
+            munmap(cq, cqsize);
+        if (a->sqes != MAP_FAILED)
+            munmap(a->sqes, sqesize);
+        goto fail;
+    }
+
+    a->entries = p.sq_entries;
+    a->sq_head = (unsigned *)(sq + p.sq_off.head);
+    a->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    a->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    a->sq_array = (unsigned *)(sq + p.sq_off.array);
+    a->cq_head = (unsigned *)(cq + p.cq_off.head);
+    a->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    a->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    a->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+  fail:
+    close(a->ring);
+    return -1;
+}
+
+/*
+ * uring_queue() - write an operation into the next submission slot
+ */
+static void uring_queue(struct aio *a, struct aio_op *op) {
+    unsigned tail = *a->sq_tail, idx = tail & *a->sq_mask;
+    struct io_uring_sqe *sqe = &a->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->addr = (uintptr_t)op->buf;
+    sqe->len = op->len;
+    sqe->off = op->offset;
+    switch (op->type) {
+      case AIO_OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->len = op->mode;
+        sqe->off = 0;
+        sqe->open_flags = op->flags;
+        break;
+      case AIO_READ:  sqe->opcode = IORING_OP_READ; break;
+      case AIO_WRITE: sqe->opcode = IORING_OP_WRITE; break;
+      case AIO_FSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = op->flags & AIO_DATASYNC ? IORING_FSYNC_DATASYNC
+                                                    : 0;
+        break;
+    }
+    sqe->user_data = (uintptr_t)op;
+    a->sq_array[idx] = idx;
+    __atomic_store_n(a->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    a->inflight++;
+    a->queued++;
+}
+
+/*
+ * run() - make an operation's system call, or do its work, for the threads
+ */
+static long run(struct aio_op *op) {
+    long res;
+    switch (op->type) {
+      case AIO_CALL:
+        return op->call(op);
+      case AIO_OPEN:
+        res = open(op->path, op->flags, op->mode);
+        break;
+      case AIO_READ:
+        res = pread(op->fd, op->buf, op->len, op->offset);
+        break;
+      case AIO_WRITE:
+        res = pwrite(op->fd, op->buf, op->len, op->offset);
+        break;
+      default:
+        res = op->flags & AIO_DATASYNC ? fdatasync(op->fd) : fsync(op->fd);
+        break;
+    }
+    return res < 0 ? -errno : res;
+}
+
+/*
+ * worker() - carry out operations for an aio without io_uring
+ */
+static void *worker(void *arg) {
+    struct aio *a = arg;
+    pthread_mutex_lock(&a->lock);
+    while (1) {
+        struct aio_op *op;
+        while ((op = pop(&a->todo)) == NULL)
+            pthread_cond_wait(&a->wake, &a->lock);
+        pthread_mutex_unlock(&a->lock);
+        op->res = run(op);
+        pthread_mutex_lock(&a->lock);
+        push(&a->finished, op);
+        uint64_t one = 1;
+        if (write(a->efd, &one, sizeof(one)) < 0)
+            ;   /* only fails if the counter is full, which still wakes */
+    }
+    return NULL;
+}
+
+/*
+ * pool_open() - start the threads of an aio without io_uring.  Returns 0,
+ *               or -1 on failure.
+ */
+static int pool_open(struct aio *a) {
+    for (int i = 0; i < AIO_THREADS; i++) {
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, worker, a);
+        if (rc != 0) {
+            errno = rc;
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    a->threads = 1;
+    return 0;
+}
+
+struct aio *aio_create(enum aio_engine engine) {
+    struct aio *a = calloc(1, sizeof(*a));
+    if (a == NULL || engine == AIO_NONE)
+        goto fail;
+    if ((a->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto fail;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->wake, NULL);
+    if (engine == AIO_URING && uring_open(a) == 0) {
+        a->engine = AIO_URING;
+        return a;
+    }
+    if (pool_open(a) < 0) {
+        close(a->efd);
+        goto fail;
+    }
+    a->engine = AIO_POOL;
+    return a;
+
+  fail:
+    free(a);
+    return NULL;
+}
+
+int aio_fd(struct aio *a) {
+    return a->efd;
+}
+
+int aio_submit(struct aio *a, struct aio_op *op) {
+    if (a->engine == AIO_POOL || op->type == AIO_CALL) {
+        if (!a->threads && pool_open(a) < 0)
+            return -1;
+        pthread_mutex_lock(&a->lock);
+        push(&a->todo, op);
+        pthread_cond_signal(&a->wake);
+        pthread_mutex_unlock(&a->lock);
+        return 0;
+    }
+    /* the completion ring holds twice what the submission ring does, so
+       keeping no more than that in flight means it can't overflow */
+    if (a->inflight < a->entries)
+        uring_queue(a, op);
+    else
+        push(&a->waiting, op);
+    return 0;
+}
+
+void aio_flush(struct aio *a) {
+    while (a->engine == AIO_URING && a->queued) {
+        int n = syscall(__NR_io_uring_enter, a->ring, a->queued, 0, 0,
+                        NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error in io_uring_enter(): %s\n",
+                    strerror(errno));
+            exit(0);
+        }
+        a->queued -= n;
+    }
+}
+
+void aio_reap(struct aio *a) {
+    uint64_t ticks;
+    if (read(a->efd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+        return;
+
+    /* the threads and the ring tick the same eventfd */
+    if (a->threads) {
+        pthread_mutex_lock(&a->lock);
+        struct queue done = a->finished;
+        a->finished.head = a->finished.tail = NULL;
+        pthread_mutex_unlock(&a->lock);
+        struct aio_op *op;
+        while ((op = pop(&done)) != NULL)
+            op->done(op, op->res);
+    }
+    if (a->engine == AIO_POOL)
+        return;
+
+    unsigned head = *a->cq_head;
+    while (head != __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &a->cqes[head & *a->cq_mask];
+        struct aio_op *op = (struct aio_op *)(uintptr_t)cqe->user_data;
+        long res = cqe->res;
+        /* free the slot before done() can submit more */
+        __atomic_store_n(a->cq_head, ++head, __ATOMIC_RELEASE);
+        a->inflight--;
+        op->done(op, res);
+        head = *a->cq_head;
+    }
+    struct aio_op *op;
+    while (a->inflight < a->entries && (op = pop(&a->waiting)) != NULL)
+        uring_queue(a, op);
+}
@@ -0,0 +1,92 @@
+#ifndef AIO_H__
+#define AIO_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Disk I/O that doesn't block the caller, for the event loops.  Opens,
+ * reads, writes and fsyncs are handed to the kernel through io_uring where
+ * it supports them, or else to a few threads of our own that make the
+ * ordinary system calls, and either way the owner of the aio learns of
+ * completions through a file descriptor it can poll.  An aio belongs to
+ * one thread: only it may submit operations and reap their results.
+ *
+ * Work that is more than one system call, or that has no asynchronous
+ * form, such as a sendfile() that may wait on the disk, can be handed over
+ * whole as an AIO_CALL.  Calls always run on the threads, which an aio on
+ * io_uring starts the first time it is given one.
+ *
+ * Operations are started in the order they are submitted, but may finish
+ * in any order.  At most AIO_DEPTH are in flight at once; any more wait
+ * their turn inside the aio.
+ */
+
+/* Operations an aio runs at once, and threads it uses without io_uring */
+#define AIO_DEPTH   256
+#define AIO_THREADS 4
+
+/* How an aio does its work */
+enum aio_engine { AIO_NONE, AIO_URING, AIO_POOL, AIO_NENGINES };
+
+enum aio_type { AIO_OPEN, AIO_READ, AIO_WRITE, AIO_FSYNC, AIO_CALL };
+
+/* For an AIO_FSYNC, in flags: flush the data but not the metadata */
+#define AIO_DATASYNC 1
+
+struct aio;
+
+struct aio_op {
+    enum aio_type  type;
+    int            fd;          /* READ, WRITE and FSYNC */
+    const char    *path;        /* OPEN, from the working directory */
+    int            flags;       /* OPEN: as for open(); FSYNC: AIO_DATASYNC */
+    mode_t         mode;        /* OPEN: for a file it creates */
+    char          *buf;         /* READ and WRITE */
+    size_t         len;
+    off_t          offset;
+    /* CALL: the work, returning what done() is to be given */
+    long         (*call)(struct aio_op *op);
+    /* called by aio_reap() with what the system call returned, or -errno */
+    void         (*done)(struct aio_op *op, long res);
+    void          *arg;         /* the caller's */
+    struct aio_op *next;        /* the aio's */
+    long           res;
+};
+
+/*
+ * aio_engine_parse() - the engine with this name ("none", "uring" or
+ *                      "threads"), or -1 if there is none
+ */
+int aio_engine_parse(const char *name);
+
+/*
+ * aio_create() - start an aio.  AIO_URING falls back to AIO_POOL if the
+ *                kernel lacks what it needs.  Returns NULL for AIO_NONE,
+ *                or on failure.
+ */
+struct aio *aio_create(enum aio_engine engine);
+
+/*
+ * aio_fd() - a descriptor that polls readable when aio_reap() has work
+ */
+int aio_fd(struct aio *a);
+
+/*
+ * aio_submit() - start an operation; its done() is called from a later
+ *                aio_reap().  Returns 0, or -1 if it can't be started.
+ */
+int aio_submit(struct aio *a, struct aio_op *op);
+
+/*
+ * aio_flush() - make sure the kernel has everything submitted so far.
+ *               Submissions are batched until this is called.
+ */
+void aio_flush(struct aio *a);
+
+/*
+ * aio_reap() - call done() for every operation that has finished
+ */
+void aio_reap(struct aio *a);
+
+#endif
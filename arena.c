@@ -0,0 +1,116 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "arena.h"
+
+/* Arena allocations are rounded up to keep the next one aligned */
+#define ARENA_ALIGN 16
+
+/*
+ * A run of arena memory: a pooled buffer, or for an allocation too big for
+ * one, a block of its own
+ */
+struct block {
+    struct block *next;
+    size_t        size;             /* bytes usable in data */
+    size_t        used;
+    int           pooled;
+    char          data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+/* Free buffers, linked through their first bytes */
+static struct {
+    pthread_mutex_t lock;
+    void           *free;
+    int             count;
+} pool = { PTHREAD_MUTEX_INITIALIZER };
+
+void *buffer_get(void) {
+    pthread_mutex_lock(&pool.lock);
+    void *buf = pool.free;
+    if (buf) {
+        pool.free = *(void **)buf;
+        pool.count--;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return buf ? buf : malloc(BUF_SIZE);
+}
+
+void buffer_put(void *buf) {
+    if (buf == NULL)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    if (pool.count < BUF_KEEP) {
+        *(void **)buf = pool.free;
+        pool.free = buf;
+        pool.count++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    free(buf);
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct block *b = a->head;
+    if (b && b->size - b->used >= size) {
+        b->used += size;
+        return b->data + b->used - size;
+    }
+
+    /* start a new buffer, or give a big allocation a block to itself */
+    int pooled = size <= BUF_SIZE - sizeof(struct block);
+    size_t bytes = pooled ? BUF_SIZE : sizeof(struct block) + size;
+    if (a->total + bytes > ARENA_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((b = pooled ? buffer_get() : malloc(bytes)) == NULL)
+        return NULL;
+    b->size = bytes - sizeof(struct block);
+    b->used = size;
+    b->pooled = pooled;
+    a->total += bytes;
+
+    /* a block of its own has no room to spare, so keep filling the head */
+    if (!pooled && a->head) {
+        b->next = a->head->next;
+        a->head->next = b;
+    }
+    else {
+        b->next = a->head;
+        a->head = b;
+    }
+    return b->data;
+}
+
+char *arena_printf(struct arena *a, int *len, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char *s = n < 0 ? NULL : arena_alloc(a, n + 1);
+    if (s == NULL)
+        return NULL;
+    va_start(ap, fmt);
+    vsnprintf(s, n + 1, fmt, ap);
+    va_end(ap);
+    *len = n;
+    return s;
+}
+
+void arena_reset(struct arena *a) {
+    struct block *b = a->head;
+    while (b) {
+        struct block *next = b->next;
+        if (b->pooled)
+            buffer_put(b);
+        else
+            free(b);
+        b = next;
+    }
+    a->head = NULL;
+    a->total = 0;
+}
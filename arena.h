@@ -0,0 +1,72 @@
+#ifndef ARENA_H__
+#define ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * Memory for the server's connections, recycled rather than allocated per
+ * request.
+ *
+ * I/O buffers come from a pool shared by every thread.  They are all
+ * BUF_SIZE bytes, enough for a PUT_CHUNK, a read-ahead buffer, or a
+ * compressed frame of FRAME_RAW_MAX bytes, so one free list serves them
+ * all.  A returned buffer is kept for the next taker unless BUF_KEEP are
+ * already waiting, so the pool is as large as the busiest moment needs and
+ * no larger.
+ *
+ * Each connection also has an arena for the things that live exactly as
+ * long as one request: the request header, what is parsed out of it, and
+ * the response header.  Allocation is a pointer bump within pool buffers,
+ * nothing is freed individually, and arena_reset() hands every buffer back
+ * at the end of the request, so an idle connection holds no memory.  An
+ * arena never grows past ARENA_MAX bytes, however a client sizes its
+ * request.
+ */
+
+/* The size of a pooled buffer, and how many the pool keeps when idle */
+#define BUF_SIZE (72 * 1024)
+#define BUF_KEEP 256
+
+/* The most one arena may hold */
+#define ARENA_MAX (512 * 1024)
+
+struct block;
+
+struct arena {
+    struct block *head;     /* the block being filled, then older ones */
+    size_t        total;    /* bytes held, against ARENA_MAX */
+};
+
+/*
+ * buffer_get() - a BUF_SIZE buffer from the pool.  Returns NULL if out of
+ *                memory.
+ */
+void *buffer_get(void);
+
+/*
+ * buffer_put() - give a buffer from buffer_get() back to the pool.  NULL is
+ *                ignored.
+ */
+void buffer_put(void *buf);
+
+/*
+ * arena_alloc() - size bytes from an arena, aligned for any type.  Returns
+ *                 NULL if that would take the arena past ARENA_MAX, or if
+ *                 out of memory.
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/*
+ * arena_printf() - sprintf() into an arena.  Returns the string, and its
+ *                  length in *len, or NULL on failure.
+ */
+char *arena_printf(struct arena *a, int *len, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*
+ * arena_reset() - free everything allocated from an arena, leaving it
+ *                 empty and ready for reuse
+ */
+void arena_reset(struct arena *a);
+
+#endif
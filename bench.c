@@ -0,0 +1,661 @@
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <search.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "support.h"
+
+/*
+ * A load generator for the file server.  A number of threads, each with a
+ * connection of its own, issue a mix of GETs and PUTs for a set of files
+ * as fast as the server answers them, and the latency of every request is
+ * kept so that the tail can be reported as well as the throughput.  Which
+ * file a request names follows a Zipf distribution, so that a few hot
+ * files take most of the requests, and the sizes of the files are spread
+ * evenly on a log scale between a minimum and a maximum.  Every file is
+ * PUT once before the clock starts, so that GETs find something.
+ *
+ * Alternatively, the requests can be replayed from a server's access log,
+ * in the order it logged them, so that a cache can be judged on a real
+ * workload.  Either way, the server's cache counters are read before and
+ * after the run, and its hit ratio over the run is reported.
+ */
+
+/* Bytes to read from a GET response at a time */
+#define BUFSIZE 65536
+
+/* Largest response header we expect */
+#define MAX_HEADER 4096
+
+/* Longest access log line, and file name, that a replay keeps */
+#define MAX_LINE 1024
+
+/*
+ * help() - Print a help message
+ */
+void help(char *progname)
+{
+    printf("Usage: %s [OPTIONS]\n", progname);
+    printf("Load a file server with GETs and PUTs, and report how it coped\n");
+    printf("  -s    server info (IP or hostname)\n");
+    printf("  -p    port on which to contact server\n");
+    printf("  -c    number of concurrent connections (default 8)\n");
+    printf("  -n    number of requests to send (default 10000)\n");
+    printf("  -d    instead of -n, send requests for this many seconds\n");
+    printf("  -g    percentage of requests that are GETs (default 90)\n");
+    printf("  -f    number of distinct files (default 100)\n");
+    printf("  -z    Zipf exponent of file popularity; 0 is uniform (default 1)\n");
+    printf("  -m    smallest file size (K and M suffixes allowed; default 1K)\n");
+    printf("  -M    largest file size (default 1M)\n");
+    printf("  -k    send every request of a connection over it (server needs -k)\n");
+    printf("  -x    prefix of the files' names (default \"bench\")\n");
+    printf("  -r    replay the GETs and PUTs of this server access log instead;\n");
+    printf("        with -d, the log repeats until time is up\n");
+    exit(0);
+}
+
+/*
+ * die() - print an error and exit the program
+ */
+void die(const char *msg1, char *msg2)
+{
+    fprintf(stderr, "%s, %s\n", msg1, msg2);
+    exit(0);
+}
+
+/*
+ * The workload, as set on the command line
+ */
+struct sockaddr_in server_addr;
+int    nconns = 8;
+long   nrequests = 10000;
+double duration = 0;
+int    get_pct = 90;
+int    nfiles = 100;
+double zipf_s = 1.0;
+long   min_size = 1024;
+long   max_size = 1024 * 1024;
+int    keepalive = 0;
+char  *prefix = "bench";
+
+/* File names and sizes, and the cumulative popularity of the files */
+char  **names;
+long   *sizes;
+double *popularity;
+
+/* With -r, the requests to replay, in order */
+struct op {
+    int get;
+    int file;
+};
+struct op *trace;
+long       ntrace;
+
+/* Bytes that PUTs send, enough for the largest file */
+char *contents;
+
+/* Requests handed out so far, with -n, and whether time is up, with -d */
+long issued = 0;
+int  stopping = 0;
+
+/*
+ * parse_size() - read a byte count with an optional K or M suffix
+ */
+long parse_size(char *arg)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+    if (*end == 'K' || *end == 'k')
+        n *= 1024;
+    else if (*end == 'M' || *end == 'm')
+        n *= 1024 * 1024;
+    else if (*end != '\0')
+        die("Usage error", "bad size");
+    if (n < 0)
+        die("Usage error", "bad size");
+    return n;
+}
+
+/*
+ * now_ns() - a monotonic clock, in nanoseconds
+ */
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * make_workload() - name and size each file, and work out how popular each
+ *                   one is, unless a replay has done so already
+ */
+void make_workload(void)
+{
+    contents = malloc(max_size ? max_size : 1);
+    if (contents == NULL)
+        die("Out of memory", "workload");
+
+    /* the same seed gives the same sizes every run */
+    unsigned short seed[3] = { 303, 303, 303 };
+    if (trace == NULL) {
+        names = malloc(nfiles * sizeof(*names));
+        sizes = malloc(nfiles * sizeof(*sizes));
+        popularity = malloc(nfiles * sizeof(*popularity));
+        if (names == NULL || sizes == NULL || popularity == NULL)
+            die("Out of memory", "workload");
+        double lo = log(min_size + 1), hi = log(max_size + 1);
+        double total = 0;
+        for (int i = 0; i < nfiles; i++) {
+            size_t len = strlen(prefix) + 16;
+            if ((names[i] = malloc(len)) == NULL)
+                die("Out of memory", "workload");
+            snprintf(names[i], len, "%s%05d", prefix, i);
+            sizes[i] = (long)exp(lo + erand48(seed) * (hi - lo)) - 1;
+            total += pow(i + 1, -zipf_s);
+            popularity[i] = total;
+        }
+        for (int i = 0; i < nfiles; i++)
+            popularity[i] /= total;
+    }
+    for (long i = 0; i < max_size; i++)
+        contents[i] = 'a' + nrand48(seed) % 26;
+}
+
+/*
+ * load_trace() - read the successful GETs and PUTs out of an access log.
+ *                Each distinct name becomes a file, as large as the most
+ *                bytes any request for it moved.
+ */
+void load_trace(char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        die("Error opening access log", strerror(errno));
+
+    /* the table of names can't grow, so size it from the number of lines */
+    char line[MAX_LINE];
+    size_t lines = 0;
+    while (fgets(line, sizeof(line), fp))
+        lines++;
+    rewind(fp);
+    if ((trace = malloc((lines ? lines : 1) * sizeof(*trace))) == NULL ||
+        (names = malloc((lines ? lines : 1) * sizeof(*names))) == NULL ||
+        (sizes = malloc((lines ? lines : 1) * sizeof(*sizes))) == NULL ||
+        hcreate(2 * lines + 16) == 0)
+        die("Out of memory", "trace");
+
+    /* "<time> <client> <type> <name> <status> <bytes> <us>" */
+    nfiles = 0;
+    max_size = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char type[8], name[MAX_LINE], status[8];
+        long bytes;
+        if (sscanf(line, "%*s %*s %7s %1023s %7s %ld", type, name, status,
+                   &bytes) != 4 || strcmp(status, "OK") != 0 ||
+            (strcmp(type, "GET") != 0 && strcmp(type, "PUT") != 0))
+            continue;
+
+        ENTRY key = { .key = name }, *found = hsearch(key, FIND);
+        if (found == NULL) {
+            key.key = strdup(name);
+            key.data = (void *)(intptr_t)nfiles;
+            if (key.key == NULL || (found = hsearch(key, ENTER)) == NULL)
+                die("Out of memory", "trace");
+            names[nfiles] = key.key;
+            sizes[nfiles++] = 0;
+        }
+        int i = (intptr_t)found->data;
+        if (bytes > sizes[i])
+            sizes[i] = bytes;
+        if (bytes > max_size)
+            max_size = bytes;
+        trace[ntrace].get = type[0] == 'G';
+        trace[ntrace++].file = i;
+    }
+    fclose(fp);
+    if (ntrace == 0)
+        die("Replay error", "no successful GETs or PUTs in the log");
+    nrequests = ntrace;
+}
+
+/*
+ * pick_file() - choose a file at random, by popularity
+ */
+int pick_file(unsigned short *seed)
+{
+    double x = erand48(seed);
+    int lo = 0, hi = nfiles - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (popularity[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Sendv() / Receive() - send all n buffers in one go, or receive exactly
+ *                       length bytes.  Unlike the client's, these report
+ *                       failure, so that one bad request counts as an error
+ *                       rather than ending the run.
+ */
+int Sendv(int fd, struct iovec *iov, int n)
+{
+    while (n) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (; n && (size_t)sent >= iov->iov_len; iov++, n--)
+            sent -= iov->iov_len;
+        if (n) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+int Receive(int fd, void *buffer, size_t length)
+{
+    char *p = buffer;
+    while (length) {
+        ssize_t n = recv(fd, p, length, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/*
+ * connect_to_server() - open a connection, or return -1
+ */
+int connect_to_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    /* requests are small and each waits for its answer */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/*
+ * receive_header() - read a response header into buf.  Returns its length,
+ *                    or -1 if it isn't an OK.
+ */
+int receive_header(int fd, char *buf)
+{
+    uint32_t size;
+    if (Receive(fd, &size, sizeof(size)) < 0 || size >= MAX_HEADER ||
+        Receive(fd, buf, size) < 0)
+        return -1;
+    buf[size] = '\0';
+    return strncmp(buf, "OK\n", 3) == 0 ? (int)size : -1;
+}
+
+/*
+ * do_request() - send one GET or PUT of file i over fd and await its
+ *                response.  Returns 0, or -1 if it failed.
+ */
+int do_request(int fd, int get, int i, char *buf)
+{
+    char header[MAX_HEADER];
+    int len;
+    if (get)
+        len = snprintf(header, sizeof(header), "GET\n%s\n", names[i]);
+    else
+        len = snprintf(header, sizeof(header), "PUT\n%s\n%ld\n", names[i],
+                       sizes[i]);
+    uint32_t size = len;
+    struct iovec iov[3] = {
+        { &size, sizeof(size) }, { header, len }, { contents, sizes[i] }
+    };
+    if (Sendv(fd, iov, get ? 2 : 3) < 0 || receive_header(fd, header) < 0)
+        return -1;
+    if (!get)
+        return 0;
+
+    /* "OK\n<name>\n<size>\n", then the file, which we throw away */
+    char *line = strchr(header + 3, '\n');
+    if (line == NULL)
+        return -1;
+    for (long left = atol(line + 1); left > 0; ) {
+        size_t n = left < BUFSIZE ? left : BUFSIZE;
+        if (Receive(fd, buf, n) < 0)
+            return -1;
+        left -= n;
+    }
+    return 0;
+}
+
+/*
+ * The latencies one thread saw, in nanoseconds, of GETs or of PUTs
+ */
+struct samples {
+    uint64_t *ns;
+    size_t    n;
+    size_t    cap;
+};
+
+/*
+ * record() - keep one latency
+ */
+void record(struct samples *s, uint64_t ns)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        if ((s->ns = realloc(s->ns, s->cap * sizeof(*s->ns))) == NULL)
+            die("Out of memory", "latencies");
+    }
+    s->ns[s->n++] = ns;
+}
+
+/*
+ * What each thread did
+ */
+struct worker {
+    pthread_t      tid;
+    int            id;
+    struct samples lat[2];      /* PUTs, then GETs */
+    long           bytes;
+    long           errors;
+};
+
+/*
+ * next_request() - the number of a thread's next request, or -1 if the
+ *                  run is over
+ */
+long next_request(void)
+{
+    long n = __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED);
+    if (duration > 0)
+        return __atomic_load_n(&stopping, __ATOMIC_RELAXED) ? -1 : n;
+    return n < nrequests ? n : -1;
+}
+
+/*
+ * run_worker() - issue requests until the run is over
+ */
+void *run_worker(void *arg)
+{
+    struct worker *w = arg;
+    unsigned short seed[3] = { w->id, w->id >> 16, 1 };
+    char *buf = malloc(BUFSIZE);
+    int fd = -1;
+    if (buf == NULL)
+        die("Out of memory", "buffer");
+
+    long n;
+    while ((n = next_request()) >= 0) {
+        int get, i;
+        if (trace) {
+            get = trace[n % ntrace].get;
+            i = trace[n % ntrace].file;
+        }
+        else {
+            get = nrand48(seed) % 100 < get_pct;
+            i = pick_file(seed);
+        }
+        uint64_t start = now_ns();
+        int rc = -1;
+        if (fd >= 0 || (fd = connect_to_server()) >= 0)
+            rc = do_request(fd, get, i, buf);
+        uint64_t end = now_ns();
+
+        /* a connection is only reused with keep-alive, and after success */
+        if (fd >= 0 && (!keepalive || rc < 0)) {
+            close(fd);
+            fd = -1;
+        }
+        if (rc < 0) {
+            w->errors++;
+            continue;
+        }
+        record(&w->lat[get], end - start);
+        w->bytes += sizes[i];
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return NULL;
+}
+
+/*
+ * populate() - PUT every file once, so that GETs have something to fetch
+ */
+void populate(void)
+{
+    int fd = -1;
+    for (int i = 0; i < nfiles; i++) {
+        if (fd < 0 && (fd = connect_to_server()) < 0)
+            die("Error connecting", strerror(errno));
+        if (do_request(fd, 0, i, NULL) < 0)
+            die("Populate error", "PUT failed");
+        if (!keepalive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+/*
+ * The server's cache counters, from its STATS
+ */
+struct cache_stats {
+    long hits;
+    long misses;
+    long evictions;
+    long rejections;
+    char policy[32];
+};
+
+/*
+ * stat_value() - the number on the line of a STATS response that starts
+ *                with name, or 0 if there is none
+ */
+long stat_value(const char *text, const char *name)
+{
+    size_t len = strlen(name);
+    for (const char *p = text; p; p = strchr(p, '\n')) {
+        p += *p == '\n';
+        if (strncmp(p, name, len) == 0 && p[len] == ' ')
+            return atol(p + len + 1);
+    }
+    return 0;
+}
+
+/*
+ * server_stats() - ask the server for its cache counters.  Returns 0, or -1
+ *                  if it wouldn't say.
+ */
+int server_stats(struct cache_stats *cs)
+{
+    int fd = connect_to_server();
+    if (fd < 0)
+        return -1;
+    uint32_t size = strlen("STATS\n");
+    struct iovec iov[2] = { { &size, sizeof(size) }, { "STATS\n", size } };
+    char *text = NULL;
+    int rc = -1;
+    if (Sendv(fd, iov, 2) == 0 && Receive(fd, &size, sizeof(size)) == 0 &&
+        (text = malloc(size + 1)) != NULL && Receive(fd, text, size) == 0) {
+        text[size] = '\0';
+        if (strncmp(text, "OK\n", 3) == 0) {
+            cs->hits = stat_value(text, "cache_hits");
+            cs->misses = stat_value(text, "cache_misses");
+            cs->evictions = stat_value(text, "cache_evictions");
+            cs->rejections = stat_value(text, "cache_rejections");
+            char *p = strstr(text, "\ncache_policy ");
+            if (p == NULL || sscanf(p, "\ncache_policy %31s", cs->policy) != 1)
+                strcpy(cs->policy, "?");
+            rc = 0;
+        }
+    }
+    free(text);
+    close(fd);
+    return rc;
+}
+
+/*
+ * compare_ns() - qsort() order for latencies
+ */
+int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * report() - print throughput and latency percentiles for one kind of
+ *            request, gathered from every thread
+ */
+void report(const char *what, struct worker *w, int kind, double secs)
+{
+    size_t n = 0;
+    for (int t = 0; t < nconns; t++)
+        n += w[t].lat[kind].n;
+    if (n == 0)
+        return;
+    uint64_t *all = malloc(n * sizeof(*all));
+    if (all == NULL)
+        die("Out of memory", "report");
+    size_t k = 0;
+    for (int t = 0; t < nconns; t++)
+        for (size_t j = 0; j < w[t].lat[kind].n; j++)
+            all[k++] = w[t].lat[kind].ns[j];
+    qsort(all, n, sizeof(*all), compare_ns);
+
+    /* the percentile is the smallest latency that many requests beat */
+    double pct[] = { 50, 99, 99.9 };
+    printf("%-4s %9zu req %10.1f req/s", what, n, n / secs);
+    for (int p = 0; p < 3; p++) {
+        size_t idx = (size_t)ceil(pct[p] / 100 * n);
+        printf("  p%g %8.3f ms", pct[p], all[idx ? idx - 1 : 0] / 1e6);
+    }
+    printf("  max %8.3f ms\n", all[n - 1] / 1e6);
+    free(all);
+}
+
+int main(int argc, char **argv)
+{
+    /* for getopt */
+    long  opt;
+    char *server = NULL;
+    int   port = 0;
+    char *replay = NULL;
+
+    check_team(argv[0]);
+
+    /* parse the command-line options. */
+    while ((opt = getopt(argc, argv, "hs:p:c:n:d:g:f:z:m:M:kx:r:")) != -1) {
+        switch(opt) {
+          case 'h': help(argv[0]); break;
+          case 's': server = optarg; break;
+          case 'p': port = atoi(optarg); break;
+          case 'c': nconns = atoi(optarg); break;
+          case 'n': nrequests = atol(optarg); break;
+          case 'd': duration = atof(optarg); break;
+          case 'g': get_pct = atoi(optarg); break;
+          case 'f': nfiles = atoi(optarg); break;
+          case 'z': zipf_s = atof(optarg); break;
+          case 'm': min_size = parse_size(optarg); break;
+          case 'M': max_size = parse_size(optarg); break;
+          case 'k': keepalive = 1; break;
+          case 'x': prefix = optarg; break;
+          case 'r': replay = optarg; break;
+        }
+    }
+    if (server == NULL || port <= 0)
+        die("Usage error", "-s and -p are required");
+    if (nconns < 1 || nfiles < 1 || min_size > max_size || get_pct < 0 ||
+        get_pct > 100 || zipf_s < 0)
+        die("Usage error", "bad workload");
+
+    /* look the server up once, rather than on every connection */
+    struct hostent *hp = gethostbyname(server);
+    if (hp == NULL)
+        die("DNS error", server);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    memcpy(&server_addr.sin_addr.s_addr, hp->h_addr_list[0], hp->h_length);
+    server_addr.sin_port = htons(port);
+
+    if (replay)
+        load_trace(replay);
+    make_workload();
+    populate();
+    struct cache_stats before, after;
+    int have_stats = server_stats(&before) == 0;
+
+    struct worker *w = calloc(nconns, sizeof(*w));
+    if (w == NULL)
+        die("Out of memory", "threads");
+    uint64_t start = now_ns();
+    for (int t = 0; t < nconns; t++) {
+        w[t].id = t + 1;
+        if (pthread_create(&w[t].tid, NULL, run_worker, &w[t]) != 0)
+            die("Thread error", strerror(errno));
+    }
+    if (duration > 0) {
+        struct timespec ts = { (time_t)duration,
+                               (long)((duration - (time_t)duration) * 1e9) };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+    }
+    long bytes = 0, errors = 0;
+    for (int t = 0; t < nconns; t++) {
+        pthread_join(w[t].tid, NULL);
+        bytes += w[t].bytes;
+        errors += w[t].errors;
+    }
+    double secs = (now_ns() - start) / 1e9;
+    have_stats = have_stats && server_stats(&after) == 0;
+
+    size_t done = 0;
+    for (int t = 0; t < nconns; t++)
+        done += w[t].lat[0].n + w[t].lat[1].n;
+    printf("%zu requests in %.2f s over %d connections: %.1f req/s, "
+           "%.2f MB/s, %ld errors\n", done, secs, nconns, done / secs,
+           bytes / secs / (1024 * 1024), errors);
+    report("GET", w, 1, secs);
+    report("PUT", w, 0, secs);
+    if (have_stats) {
+        long hits = after.hits - before.hits;
+        long lookups = hits + after.misses - before.misses;
+        printf("cache (%s): %ld hits, %ld misses, %.1f%% hit ratio, "
+               "%ld evictions, %ld rejections\n", after.policy, hits,
+               lookups - hits, lookups ? 100.0 * hits / lookups : 0.0,
+               after.evictions - before.evictions,
+               after.rejections - before.rejections);
+    }
+    exit(0);
+}
@@ -0,0 +1,550 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "cache.h"
+#include "sketch.h"
+#include "stats.h"
+
+/* W-TinyLFU's split of a shard: the admission window takes this percentage
+   of the entries and bytes, and the protected list this percentage of the
+   rest */
+#define WINDOW_PCT    1
+#define PROTECTED_PCT 80
+
+/*
+ * The lists a shard keeps its entries on, oldest at the tail.  CLOCK keeps
+ * them all on SEG_NEW.  W-TinyLFU puts new entries in SEG_NEW, its
+ * admission window, and those that win admission in SEG_PROBATION, from
+ * where they move up to SEG_PROTECTED if they are used again.
+ */
+enum { SEG_NEW, SEG_PROBATION, SEG_PROTECTED, SEG_COUNT };
+
+struct list {
+    struct cache_entry *head;
+    struct cache_entry *tail;
+    size_t              entries;
+    size_t              bytes;
+};
+
+/* One partition of the cache, on cache lines of its own */
+struct shard {
+    pthread_rwlock_t     lock;
+    struct cache_entry **buckets;
+    size_t               nbuckets;  /* always a power of two */
+    struct list          lists[SEG_COUNT];
+    size_t               entries;
+    size_t               bytes;
+    size_t               max_entries;
+    size_t               max_bytes;
+    enum cache_policy    policy;
+    size_t               window_entries;    /* W-TinyLFU's shares */
+    size_t               window_bytes;
+    size_t               protected_entries;
+    struct sketch        sketch;            /* W-TinyLFU: recent lookups */
+    unsigned long        gen;       /* read and bumped atomically */
+} __attribute__((aligned(64)));
+
+struct cache {
+    struct shard        *shards;
+    size_t               nshards;   /* a power of two */
+    size_t               max_entries;
+};
+
+static const char *policy_names[CACHE_NPOLICIES] = { "clock", "tinylfu" };
+
+/*
+ * hash() - FNV-1a over a NUL-terminated key
+ */
+static size_t hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *key; key++) {
+        h ^= (unsigned char)*key;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+static void entry_free(struct cache_entry *e) {
+    free(e->key);
+    if (e->mapped)
+        munmap(e->data, e->size);
+    else
+        free(e->data);
+    free(e);
+}
+
+/*
+ * shard_of() - the shard that holds key.  Buckets within a shard are chosen
+ *              by the low bits of the hash, so shards use the high ones,
+ *              after mixing: FNV-1a's last byte never reaches them, and
+ *              names that differ only at the end would share a shard.
+ */
+static struct shard *shard_of(struct cache *c, const char *key) {
+    uint64_t h = hash(key);
+    h = (h ^ (h >> 31)) * 0xbf58476d1ce4e5b9ULL;
+    return &c->shards[(h >> 32) & (c->nshards - 1)];
+}
+
+/*
+ * unref() - drop a reference to an entry, from any thread
+ */
+static void unref(struct cache_entry *e) {
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        entry_free(e);
+}
+
+/*
+ * charge() - what an entry counts for against the byte limit
+ */
+static size_t charge(const struct cache_entry *e) {
+    return e->mapped ? 0 : e->size;
+}
+
+/*
+ * entry_new() - make an entry that owns data
+ */
+static struct cache_entry *entry_new(const char *key, char *data, size_t size,
+                                     const char *digest) {
+    struct cache_entry *e = calloc(1, sizeof(*e));
+    if (e == NULL || (e->key = strdup(key)) == NULL) {
+        free(e);
+        free(data);
+        return NULL;
+    }
+    e->data = data;
+    e->size = size;
+    e->refs = 1;
+    if (digest)
+        strcpy(e->digest, digest);
+    return e;
+}
+
+/*
+ * list_unlink() / list_push() - move entries off their list, and onto the
+ *                               head of one
+ */
+static void list_unlink(struct shard *s, struct cache_entry *e) {
+    struct list *l = &s->lists[e->segment];
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        l->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        l->tail = e->prev;
+    e->prev = e->next = NULL;
+    l->entries--;
+    l->bytes -= charge(e);
+}
+
+static void list_push(struct shard *s, int segment, struct cache_entry *e) {
+    struct list *l = &s->lists[segment];
+    e->segment = segment;
+    e->prev = NULL;
+    e->next = l->head;
+    if (l->head)
+        l->head->prev = e;
+    l->head = e;
+    if (l->tail == NULL)
+        l->tail = e;
+    l->entries++;
+    l->bytes += charge(e);
+}
+
+/*
+ * find() - return the hash chain link that points at key's entry, or at the
+ *          NULL that ends its chain
+ */
+static struct cache_entry **find(struct shard *s, const char *key) {
+    struct cache_entry **p = &s->buckets[hash(key) & (s->nbuckets - 1)];
+    while (*p && strcmp((*p)->key, key) != 0)
+        p = &(*p)->hnext;
+    return p;
+}
+
+/*
+ * grow() - double the hash table once it is as full as it is wide
+ */
+static void grow(struct shard *s) {
+    size_t n = s->nbuckets * 2;
+    struct cache_entry **b = calloc(n, sizeof(*b));
+    if (b == NULL)
+        return;
+    for (size_t i = 0; i < s->nbuckets; i++) {
+        struct cache_entry *e = s->buckets[i], *next;
+        for (; e; e = next) {
+            next = e->hnext;
+            size_t h = hash(e->key) & (n - 1);
+            e->hnext = b[h];
+            b[h] = e;
+        }
+    }
+    free(s->buckets);
+    s->buckets = b;
+    s->nbuckets = n;
+}
+
+/*
+ * drop() - remove an entry from the table and list, and give up the cache's
+ *          reference to it
+ */
+static void drop(struct shard *s, struct cache_entry **link) {
+    struct cache_entry *e = *link;
+    *link = e->hnext;
+    list_unlink(s, e);
+    s->entries--;
+    s->bytes -= charge(e);
+    unref(e);
+}
+
+/*
+ * over() - whether a shard holds more than its limits allow
+ */
+static int over(const struct shard *s) {
+    return s->entries > s->max_entries || s->bytes > s->max_bytes;
+}
+
+/*
+ * evict() - drop an entry to make room
+ */
+static void evict(struct shard *s, struct cache_entry *e) {
+    stats_eviction(0);
+    drop(s, find(s, e->key));
+}
+
+/*
+ * used() - whether an entry has been looked up since the last call, which
+ *          clears its mark
+ */
+static int used(struct cache_entry *e) {
+    return __atomic_exchange_n(&e->referenced, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * clock_evict() - run the clock until the shard is back within its limits:
+ *                 the oldest entry goes, unless it has been used since the
+ *                 hand last passed, in which case it loses its mark and
+ *                 starts again at the back
+ */
+static void clock_evict(struct shard *s) {
+    while (over(s)) {
+        struct cache_entry *old = s->lists[SEG_NEW].tail;
+        if (used(old)) {
+            list_unlink(s, old);
+            list_push(s, SEG_NEW, old);
+        }
+        else
+            evict(s, old);
+    }
+}
+
+/*
+ * settle() - bring W-TinyLFU's main lists up to date with the lookups since
+ *            they were last looked at.  Hits only mark an entry, so that
+ *            they can share the shard's lock; here marked entries at the
+ *            tail of probation move up to protected, and protected's
+ *            overflow falls back to probation, marked ones getting another
+ *            turn first.
+ */
+static void settle(struct shard *s) {
+    struct list *probation = &s->lists[SEG_PROBATION];
+    struct list *protected = &s->lists[SEG_PROTECTED];
+    struct cache_entry *e;
+    while ((e = probation->tail) && used(e)) {
+        list_unlink(s, e);
+        list_push(s, SEG_PROTECTED, e);
+    }
+    while (protected->entries > s->protected_entries) {
+        e = protected->tail;
+        list_unlink(s, e);
+        list_push(s, used(e) ? SEG_PROTECTED : SEG_PROBATION, e);
+    }
+}
+
+/*
+ * next_victim() - the main-list entry to evict after e, or first if e is
+ *                 NULL: probation from the oldest, then protected likewise
+ */
+static struct cache_entry *next_victim(struct shard *s,
+                                       struct cache_entry *e) {
+    if (e && e->prev)
+        return e->prev;
+    if (e == NULL && s->lists[SEG_PROBATION].tail)
+        return s->lists[SEG_PROBATION].tail;
+    if (e == NULL || e->segment == SEG_PROBATION)
+        return s->lists[SEG_PROTECTED].tail;
+    return NULL;
+}
+
+/*
+ * admit() - let the oldest entry of the window into the main lists if it
+ *           is more popular than what it would push out, else evict it.
+ *           Its popularity is set against the total of all its victims',
+ *           not each one's, so that a big file must be worth all of the
+ *           small ones it displaces.
+ */
+static void admit(struct shard *s) {
+    struct cache_entry *cand = s->lists[SEG_NEW].tail;
+    unsigned want = sketch_count(&s->sketch, hash(cand->key));
+    settle(s);
+
+    /* count the victims, as if cand had already moved */
+    size_t entries = s->entries, bytes = s->bytes;
+    unsigned cost = 0;
+    int victims = 0;
+    struct cache_entry *e = NULL;
+    while (entries > s->max_entries || bytes > s->max_bytes) {
+        if ((e = next_victim(s, e)) == NULL ||
+            (cost += sketch_count(&s->sketch, hash(e->key))) >= want) {
+            stats_eviction(1);
+            drop(s, find(s, cand->key));
+            return;
+        }
+        entries--;
+        bytes -= charge(e);
+        victims++;
+    }
+    while (victims--)
+        evict(s, next_victim(s, NULL));
+    list_unlink(s, cand);
+    used(cand);
+    list_push(s, SEG_PROBATION, cand);
+}
+
+/*
+ * tinylfu_evict() - move the window's overflow into the main lists, then
+ *                   make sure the shard is within its limits.  A file too
+ *                   big for the window goes straight to admission.
+ */
+static void tinylfu_evict(struct shard *s) {
+    struct list *window = &s->lists[SEG_NEW];
+    while (window->entries > s->window_entries ||
+           window->bytes > s->window_bytes)
+        admit(s);
+    while (over(s)) {
+        settle(s);
+        struct cache_entry *e = next_victim(s, NULL);
+        evict(s, e ? e : window->tail);
+    }
+}
+
+/*
+ * store() - make e the entry for its key, then evict by the shard's policy
+ *           until the shard is back within its limits
+ */
+static void store(struct shard *s, struct cache_entry *e) {
+    struct cache_entry **link = find(s, e->key);
+    if (*link)
+        drop(s, link);
+    if (s->entries >= s->nbuckets)
+        grow(s);
+    link = find(s, e->key);
+    e->hnext = NULL;
+    *link = e;
+    list_push(s, SEG_NEW, e);
+    s->entries++;
+    s->bytes += charge(e);
+    if (s->policy == CACHE_TINYLFU)
+        tinylfu_evict(s);
+    else
+        clock_evict(s);
+}
+
+int cache_policy_parse(const char *name) {
+    for (int i = 0; i < CACHE_NPOLICIES; i++)
+        if (strcmp(name, policy_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+struct cache *cache_create(size_t max_entries, size_t max_bytes,
+                           enum cache_policy policy) {
+    struct cache *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->nshards = CACHE_SHARDS;
+    while (c->nshards > 1 && max_entries / c->nshards < CACHE_SHARD_MIN)
+        c->nshards /= 2;
+    c->max_entries = max_entries;
+    if (posix_memalign((void **)&c->shards, 64,
+                       c->nshards * sizeof(*c->shards)) != 0) {
+        free(c);
+        return NULL;
+    }
+    memset(c->shards, 0, c->nshards * sizeof(*c->shards));
+
+    /* the first shards take any remainder of the entry limit */
+    for (size_t i = 0; i < c->nshards; i++) {
+        struct shard *s = &c->shards[i];
+        s->max_entries = max_entries / c->nshards +
+                         (i < max_entries % c->nshards);
+        s->max_bytes = max_bytes / c->nshards;
+        s->nbuckets = 16;
+        s->buckets = calloc(s->nbuckets, sizeof(*s->buckets));
+        if (s->buckets == NULL || (policy == CACHE_TINYLFU &&
+                                   sketch_init(&s->sketch, s->max_entries))) {
+            for (size_t j = 0; j <= i; j++) {
+                free(c->shards[j].buckets);
+                sketch_free(&c->shards[j].sketch);
+            }
+            free(c->shards);
+            free(c);
+            return NULL;
+        }
+        s->policy = policy;
+        s->window_entries = s->max_entries * WINDOW_PCT / 100;
+        if (s->window_entries == 0)
+            s->window_entries = 1;
+        s->window_bytes = s->max_bytes * WINDOW_PCT / 100;
+        s->protected_entries = (s->max_entries - s->window_entries) *
+                               PROTECTED_PCT / 100;
+        pthread_rwlock_init(&s->lock, NULL);
+    }
+    stats_cache_policy(policy_names[policy]);
+    return c;
+}
+
+struct cache_entry *cache_get(struct cache *c, const char *key) {
+    struct shard *s = shard_of(c, key);
+    if (s->policy == CACHE_TINYLFU)
+        sketch_add(&s->sketch, hash(key));
+    pthread_rwlock_rdlock(&s->lock);
+    struct cache_entry *e = *find(s, key);
+    if (e) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        if (!__atomic_load_n(&e->referenced, __ATOMIC_RELAXED))
+            __atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return e;
+}
+
+int cache_has(struct cache *c, const char *key) {
+    struct shard *s = shard_of(c, key);
+    pthread_rwlock_rdlock(&s->lock);
+    int found = *find(s, key) != NULL;
+    pthread_rwlock_unlock(&s->lock);
+    return found;
+}
+
+void cache_release(struct cache *c, struct cache_entry *e) {
+    unref(e);
+}
+
+unsigned long cache_generation(struct cache *c, const char *key) {
+    return __atomic_load_n(&shard_of(c, key)->gen, __ATOMIC_ACQUIRE);
+}
+
+int cache_fits(struct cache *c, size_t size) {
+    return c->max_entries > 0 && size <= c->shards[0].max_bytes;
+}
+
+/*
+ * insert() - add a new entry unless its shard has seen an update since
+ *            generation gen was read.  Updates bump the generation while
+ *            holding the shard's lock, so an insert that gets the lock
+ *            after one sees it, and updates to other shards don't hold
+ *            up inserts to this one.
+ */
+static struct cache_entry *insert(struct cache *c, struct cache_entry *e,
+                                  unsigned long gen) {
+    struct shard *s = shard_of(c, e->key);
+    pthread_rwlock_wrlock(&s->lock);
+    if (__atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) == gen) {
+        /* the caller's reference, and a mark, keep the clock off it */
+        e->refs++;
+        e->referenced = 1;
+        store(s, e);
+        pthread_rwlock_unlock(&s->lock);
+        return e;
+    }
+    pthread_rwlock_unlock(&s->lock);
+    entry_free(e);
+    return NULL;
+}
+
+struct cache_entry *cache_insert(struct cache *c, const char *key, char *data,
+                                 size_t size, const char *digest,
+                                 unsigned long gen) {
+    if (!cache_fits(c, size)) {
+        free(data);
+        return NULL;
+    }
+    struct cache_entry *e = entry_new(key, data, size, digest);
+    if (e == NULL)
+        return NULL;
+    return insert(c, e, gen);
+}
+
+struct cache_entry *cache_insert_map(struct cache *c, const char *key,
+                                     char *map, const struct stat *st,
+                                     const char *digest, unsigned long gen) {
+    struct cache_entry *e = calloc(1, sizeof(*e));
+    if (c->max_entries == 0 || e == NULL || (e->key = strdup(key)) == NULL) {
+        free(e);
+        munmap(map, st->st_size);
+        return NULL;
+    }
+    e->data = map;
+    e->size = st->st_size;
+    e->refs = 1;
+    if (digest)
+        strcpy(e->digest, digest);
+    e->mapped = 1;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    return insert(c, e, gen);
+}
+
+void cache_update(struct cache *c, const char *key, const void *data,
+                  size_t size, const char *digest) {
+    char *copy;
+    struct cache_entry *e;
+    if (!cache_fits(c, size) || (copy = malloc(size ? size : 1)) == NULL) {
+        cache_invalidate(c, key);
+        return;
+    }
+    memcpy(copy, data, size);
+    if ((e = entry_new(key, copy, size, digest)) == NULL) {
+        cache_invalidate(c, key);
+        return;
+    }
+    /* readers still sending the old entry keep it until they are done */
+    struct shard *s = shard_of(c, key);
+    pthread_rwlock_wrlock(&s->lock);
+    __atomic_add_fetch(&s->gen, 1, __ATOMIC_RELEASE);
+    store(s, e);
+    pthread_rwlock_unlock(&s->lock);
+}
+
+void cache_walk(struct cache *c,
+                void (*fn)(const struct cache_entry *e, void *arg),
+                void *arg) {
+    /* within a shard, the least valuable first */
+    static const int order[SEG_COUNT] = {
+        SEG_PROBATION, SEG_PROTECTED, SEG_NEW
+    };
+    for (size_t i = 0; i < c->nshards; i++) {
+        struct shard *s = &c->shards[i];
+        pthread_rwlock_rdlock(&s->lock);
+        for (int k = 0; k < SEG_COUNT; k++)
+            for (struct cache_entry *e = s->lists[order[k]].tail; e;
+                 e = e->prev)
+                fn(e, arg);
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+void cache_invalidate(struct cache *c, const char *key) {
+    struct shard *s = shard_of(c, key);
+    pthread_rwlock_wrlock(&s->lock);
+    __atomic_add_fetch(&s->gen, 1, __ATOMIC_RELEASE);
+    struct cache_entry **link = find(s, key);
+    if (*link)
+        drop(s, link);
+    pthread_rwlock_unlock(&s->lock);
+}
@@ -0,0 +1,163 @@
+#ifndef CACHE_H__
+#define CACHE_H__
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "digest.h"
+
+/*
+ * A cache of whole file contents, keyed by filename, that many threads can
+ * read at once.  Keys are hashed across CACHE_SHARDS independent shards, each
+ * with its own chained hash table, lock and share of the limits, so that
+ * connections touching different files rarely meet.  A hit takes its
+ * shard's lock only for reading, and otherwise just bumps the entry's
+ * reference count and sets its reference bit, both atomically; only
+ * inserts, updates and evictions lock a shard exclusively.
+ *
+ * What to evict is up to the cache's policy, which works within each shard.
+ *
+ * CACHE_CLOCK is CLOCK (second chance) rather than strict LRU, which is
+ * what lets a hit leave the shard's list alone: each shard keeps its
+ * entries in insertion order, and to make room looks at the oldest,
+ * evicting it if it hasn't been used since it was last looked at, and
+ * otherwise clearing its bit and sending it to the back.
+ *
+ * CACHE_TINYLFU is W-TinyLFU, which resists scans.  A bulk job that reads
+ * many files once would flush a cache that only knows recency, but here
+ * every lookup is counted in a count-min sketch (see sketch.h), and a new
+ * file only gets past a small admission window into the main part of the
+ * cache if it has been asked for more often than the files it would push
+ * out, taken together, so that one big file must outweigh all the small
+ * ones it displaces.  The main part is a segmented LRU, probation then
+ * protected, kept with the same reference bits as CLOCK.
+ *
+ * Entries are reference counted and never modified once inserted, so a
+ * caller may keep sending an entry's bytes after it has been evicted or
+ * replaced by an update; the memory goes away with the last
+ * cache_release().
+ *
+ * An entry may instead hold a read-only mmap() of its file.  The kernel
+ * decides how much of a mapping is resident, so mapped bytes don't count
+ * against the byte limit, only against the entry limit.  The entry keeps
+ * the identity of the file it maps, so that callers can tell whether the
+ * name still refers to it.
+ */
+
+/* Most shards a cache is split into; small caches get fewer, so that each
+   shard holds at least CACHE_SHARD_MIN entries */
+#define CACHE_SHARDS    16
+#define CACHE_SHARD_MIN 8
+
+enum cache_policy { CACHE_CLOCK, CACHE_TINYLFU, CACHE_NPOLICIES };
+
+struct cache;
+
+struct cache_entry {
+    char               *key;
+    char               *data;
+    size_t              size;
+    char                digest[MD5_HEX_LEN + 1];    /* of data, or "" */
+    int                 mapped;     /* data is an mmap() of the file below */
+    dev_t               dev;
+    ino_t               ino;
+    struct timespec     mtime;
+    int                 refs;       /* holders, including the cache itself */
+    int                 referenced; /* used since the clock last passed */
+    int                 segment;    /* which of the shard's lists it is on */
+    struct cache_entry *hnext;      /* hash chain */
+    struct cache_entry *prev;       /* that list, newest first */
+    struct cache_entry *next;
+};
+
+/*
+ * cache_policy_parse() - the policy with this name ("clock" or "tinylfu"),
+ *                        or -1 if there is none
+ */
+int cache_policy_parse(const char *name);
+
+/*
+ * cache_create() - make a cache holding at most max_entries files and
+ *                  max_bytes of file data, divided evenly between its
+ *                  shards, that evicts by policy
+ */
+struct cache *cache_create(size_t max_entries, size_t max_bytes,
+                           enum cache_policy policy);
+
+/*
+ * cache_get() - look up a file, marking it used.  Returns a referenced
+ *               entry, or NULL on a miss.
+ */
+struct cache_entry *cache_get(struct cache *c, const char *key);
+
+/*
+ * cache_has() - whether a file is cached, without marking it used
+ */
+int cache_has(struct cache *c, const char *key);
+
+/*
+ * cache_release() - drop a reference returned by cache_get()
+ */
+void cache_release(struct cache *c, struct cache_entry *e);
+
+/*
+ * cache_generation() - a counter that changes whenever a file in the same
+ *                      shard as key is updated or invalidated.  Read it
+ *                      before reading the file for key from disk and pass
+ *                      it to cache_insert().
+ */
+unsigned long cache_generation(struct cache *c, const char *key);
+
+/*
+ * cache_insert() - add a file that was read from disk into a malloc()ed
+ *                  buffer, which the cache takes over, along with its MD5
+ *                  if it is known (else NULL).  Returns the new entry
+ *                  with a reference for the caller, or NULL (having freed
+ *                  data) if key's shard has seen an update since
+ *                  generation gen was read, since the bytes might then be
+ *                  stale.
+ */
+struct cache_entry *cache_insert(struct cache *c, const char *key, char *data,
+                                 size_t size, const char *digest,
+                                 unsigned long gen);
+
+/*
+ * cache_insert_map() - cache_insert() for a mapping of the whole file
+ *                      described by st, which the cache takes over and
+ *                      unmaps when the last reference goes.  Only the
+ *                      entry limit applies.
+ */
+struct cache_entry *cache_insert_map(struct cache *c, const char *key,
+                                     char *map, const struct stat *st,
+                                     const char *digest, unsigned long gen);
+
+/*
+ * cache_update() - replace a file's contents with freshly written bytes, and
+ *                  their MD5 if it is known (else NULL)
+ */
+void cache_update(struct cache *c, const char *key, const void *data,
+                  size_t size, const char *digest);
+
+/*
+ * cache_invalidate() - forget a file whose contents have changed
+ */
+void cache_invalidate(struct cache *c, const char *key);
+
+/*
+ * cache_walk() - call fn on every entry, each shard's oldest and least
+ *                used first, so that inserting them again in the same
+ *                order rebuilds much the same cache.  fn runs under a
+ *                shard's read lock, so it must be quick and must not call
+ *                back into the cache.
+ */
+void cache_walk(struct cache *c,
+                void (*fn)(const struct cache_entry *e, void *arg),
+                void *arg);
+
+/*
+ * cache_fits() - whether a file of this size could be cached at all, which
+ *                is to say within one shard's share of the byte limit
+ */
+int cache_fits(struct cache *c, size_t size);
+
+#endif
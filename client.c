@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -15,16 +16,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include "compress.h"
+#include "digest.h"
+#include "support.h"
 
 #define CUSTOM_EOF '$'
 #define BUFSIZE 8192
 #define RSIZE 256
 #define HEADERSIZE 128
 
+/* Server limits on a request: header bytes, and files per MGET */
+#define MAX_HEADER 65536
+#define MGET_MAX 1024
+
+/* Smallest share of a file worth its own connection with -n */
+#define STREAM_MIN (1024 * 1024)
+
 /*
  * help() - Print a help message
  */
@@ -37,6 +50,19 @@ void help(char *progname)
     printf("  -s    server info (IP or hostname)\n");
     printf("  -p    port on which to contact server\n");
     printf("  -S    for GETs, name to use when saving file locally\n");
+    printf("  -k    send every PUT and GET over one connection (server needs -k)\n");
+    printf("  -w    with -k, how many requests to send before awaiting responses\n");
+    printf("  -m    manifest file of transfers, one per line: PUT name | GET name [save]\n");
+    printf("  -M    fetch consecutive GETs together with MGET requests, unless\n");
+    printf("        -d, -c, -z or -r needs them one at a time\n");
+    printf("  -n    move large files over this many parallel connections\n");
+    printf("  -r    resume GETs from the size of an existing local copy\n");
+    printf("  -d    check every PUT and GET against the server's MD5\n");
+    printf("  -c    remember fetched files in this file, and GET them again only if changed\n");
+    printf("  -D    upload only files whose content the server lacks (server needs -s)\n");
+    printf("  -z    compress file contents on the wire\n");
+    printf("  -T    print the server's statistics\n");
+    printf("-P and -G may be repeated; -S applies to the -G before it\n");
 }
 
 /*
@@ -172,12 +198,44 @@ void Send(int connfd, void * buffer, int length)
 }
 
 /*
- * - Send_Int() - uses Send() to send one int
+ * - Sendv() - writev wrapper; sends all n buffers, in order
  */
-void Send_Int(int connfd, uint32_t val){
-    Send(connfd, &val, sizeof(val));
-    //return return_value;
-    //return ntohl(return_value);
+void Sendv(int connfd, struct iovec * iov, int n)
+{
+    while(n){
+        ssize_t bytes_sent = writev(connfd, iov, n);
+        if (bytes_sent < 0)
+        {
+            if (errno != EINTR)
+                die("Put_file write error", strerror(errno));
+            continue;
+        }
+        while(n && (size_t)bytes_sent >= iov->iov_len){
+            bytes_sent -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n){
+            iov->iov_base = (char *)iov->iov_base + bytes_sent;
+            iov->iov_len -= bytes_sent;
+        }
+    }
+}
+
+/*
+ * - Send_Request() - uses Sendv() to send a request header after its
+ *                    length, and then size bytes of body, in one write so
+ *                    that a small request goes out as one packet
+ */
+void Send_Request(int connfd, const char * header, uint32_t header_size,
+                  void * body, long size)
+{
+    struct iovec iov[3] = {
+        { &header_size, sizeof(header_size) },
+        { (char *)header, header_size },
+        { body, size }
+    };
+    Sendv(connfd, iov, size ? 3 : 2);
 }
 
 /*
@@ -190,7 +248,7 @@ unsigned char Receive(int connfd, void * buffer, int length)
     int bytes_received = 1;
     while(length && !return_value)
     {
-        bytes_received = recv(connfd, buffer, length, 0);
+        bytes_received = recv(connfd, buf_location, length, 0);
         if(!bytes_received)
         {
             return_value = 1;
@@ -226,166 +284,1086 @@ int check_header(const char * str1, const char * str2)
 */
 
 /*
- * put_file() - send a file to the server accessible via the given socket fd
+ * check_digest() - compare the MD5 a server reported, in a header line
+ *                  "MD5 <hex>", with the one computed here
  */
-void put_file(int fd, char *put_name) 
+void check_digest(char *header, const char *digest, char *who)
 {
-    /* open file and check for error */
-    FILE * fp = fopen(put_name, "rb");   
-    if (fp == NULL)
-        die("Put_file file error", "file not found");
-     
-    /* get file size */
-    fseek(fp, 0, SEEK_END);
-    int file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    char file_buf[file_size];
-
-    /* store file in buffer */
-    size_t bytes_read = fread(file_buf, sizeof(unsigned char), file_size, fp);
-    if (bytes_read != file_size)
-    {
-            fclose(fp);
-            die("Put_file fread error", "bytes_read != file_size");
-    }
+    char *line = strstr(header, "\nMD5 ");
+    if (line == NULL)
+        fprintf(stderr, "%s: server sent no MD5; transfer not verified\n", who);
+    else if (strncasecmp(line + 5, digest, MD5_HEX_LEN))
+        die(who, "MD5 mismatch; file corrupted in transfer");
+}
 
-    /* hacky way to get number of digits in the file size */
-    int j = 1, temp_size = file_size / 10; //acount for file_size of 0
-    while (temp_size)
+/*
+ * read_chunk() - read n bytes of a file that should hold them
+ */
+void read_chunk(int file, char *buf, long n)
+{
+    while (n > 0)
     {
-        j++;
-        temp_size /= 10;
+        ssize_t got = read(file, buf, n);
+        if (got <= 0)
+        {
+            if (got < 0 && errno == EINTR)
+                continue;
+            die("Put_file read error", got ? strerror(errno) : "file shrank");
+        }
+        buf += got;
+        n -= got;
     }
-    /* close file */
-    fclose(fp);
+}
+
+/*
+ * send_put_request() - send a PUT request and the file's contents to the
+ *                      server, without waiting for its answer.  Unless
+ *                      digest is NULL, the file's MD5 goes there, and the
+ *                      server is asked for the MD5 of what it stores.  With
+ *                      deflate, the contents are sent compressed.
+ */
+void send_put_request(int fd, char *put_name, char *digest, int deflate) 
+{
+    /* open file and check for error */
+    struct stat st;
+    int file = open(put_name, O_RDONLY);
+    if (file < 0 || fstat(file, &st) < 0)
+        die("Put_file file error", "file not found");
+    long size = st.st_size;
 
-    /* file size as string */
-    char str_fsize[j];
-    sprintf(str_fsize, "%d", file_size); 
-    
     /* create put request */
-    uint32_t header_size = strlen("PUT") + strlen(put_name) + strlen(str_fsize) + 3;
-    char put_header[header_size];
-    bzero(put_header, header_size);
-    strcpy(put_header, "PUT\n");
-    strcat(put_header, put_name);
-    strcat(put_header, "\n");
-    strcat(put_header, str_fsize);
-    strcat(put_header, "\n");
-
-    /* send size of header */
-    Send_Int(fd, header_size);
-    /* send put request header */
-    Send(fd, put_header, header_size);
-    /* send put file */
-    Send(fd, file_buf, file_size);
+    char put_header[strlen(put_name) + 96];
+    uint32_t header_size = sprintf(put_header, "PUT\n%s\n%ld\n%s%s", put_name,
+                                   size, digest ? "Digest\n" : "",
+                                   deflate ? "Compress deflate\n" : "");
 
+    /* send the file a chunk at a time, hashing each on its way; the header
+       rides with the first chunk, and a compressed body's end with the
+       last */
+    EVP_MD_CTX *md5 = digest ? hash_begin(EVP_md5()) : NULL;
+    char *chunk = malloc(FRAME_RAW_MAX);
+    char *frame = deflate ? malloc(frame_bound(FRAME_RAW_MAX) + FRAME_HDR)
+                          : NULL;
+    if (chunk == NULL || (deflate && frame == NULL))
+        die("Put_file", "out of memory");
+    long off = 0;
+    do
+    {
+        long n = size - off < FRAME_RAW_MAX ? size - off : FRAME_RAW_MAX;
+        read_chunk(file, chunk, n);
+        hash_update(md5, chunk, n);
+        char *data = chunk;
+        size_t len = n;
+        if (deflate)
+        {
+            len = n ? frame_encode(chunk, n, frame) : 0;
+            if (off + n == size)
+                len += frame_end(frame + len);
+            data = frame;
+        }
+        if (off == 0)
+            Send_Request(fd, put_header, header_size, data, len);
+        else
+            Send(fd, data, len);
+        off += n;
+    } while (off < size);
+    free(frame);
+    free(chunk);
+    close(file);
+
+    if (digest && hash_end(md5, digest) < 0)
+        die("Put_file", "MD5 could not be computed");
+}
+
+/*
+ * receive_put_response() - read the server's answer to a PUT, and check
+ *                          the MD5 of what it stored unless digest is NULL
+ */
+void receive_put_response(int fd, const char *digest)
+{
     /* get size of response header and create buffer */ 
     uint32_t rec_size = Receive_Int(fd);
-    char response[rec_size];
-    bzero(response, rec_size);
+    char response[rec_size + 1];
+    bzero(response, rec_size + 1);
 
     /* get response */
     if (Receive(fd, response, rec_size) != 0)
         die("Put_file", "Connection closed while reading response");
 
     /* check response */
-    if (strncmp(response, "OK\n", rec_size))
+    if (strncmp(response, "OK\n", 3))
         die("Put_file server response error", response);
+    if (digest)
+        check_digest(response, digest, "Put_file");
 }
 
 /*
- * get_file() - get a file from the server accessible via the given socket
- *              fd, and save it according to the save_name
+ * send_get_request() - ask the server for a file, from offset on, and for
+ *                      its MD5 if digest is set, without waiting for it.
+ *                      Unless token is NULL, the file is only wanted if its
+ *                      MD5 is no longer token.  With deflate, the file is
+ *                      asked for compressed.
  */
-void get_file(int fd, char *get_name, char *save_name) 
+void send_get_request(int fd, char *get_name, long offset, int digest,
+                      char *token, int deflate) 
 {
     /* create get request */
-    uint32_t request_size = strlen(get_name) + strlen("GET\n");
-    char get[request_size];
-    bzero(get, request_size);
-    strcpy(get, "GET\n");
-    strcat(get, get_name);
+    char get[strlen(get_name) + 128];
+    sprintf(get, "GET\n%s", get_name);
+    if (offset > 0 || digest || token || deflate)
+        strcat(get, "\n");
+    if (offset > 0)
+        sprintf(get + strlen(get), "Range %ld\n", offset);
+    if (digest)
+        strcat(get, "Digest\n");
+    if (token)
+        sprintf(get + strlen(get), "If-None-Match %s\n", token);
+    if (deflate)
+        strcat(get, "Compress deflate\n");
+    uint32_t request_size = strlen(get);
 
-    /* send size of request */
-    Send_Int(fd, request_size);
-    /* send request */
-    Send(fd, get, request_size);
+    /* send size of request, and request */
+    Send_Request(fd, get, request_size, NULL, 0);
+}
 
+/*
+ * receive_frames() - receive a compressed body of size bytes into fp,
+ *                    hashing what it expands to into md5 unless NULL
+ */
+void receive_frames(int fd, FILE *fp, long size, EVP_MD_CTX *md5)
+{
+    char hdr[FRAME_HDR];
+    char *payload = malloc(frame_bound(FRAME_RAW_MAX));
+    char *raw = malloc(FRAME_RAW_MAX);
+    if (payload == NULL || raw == NULL)
+        die("Get_file", "out of memory");
+    while (1)
+    {
+        uint32_t complen, rawlen;
+        if (Receive(fd, hdr, FRAME_HDR) != 0 ||
+            frame_header(hdr, &complen, &rawlen) < 0 ||
+            rawlen > size)
+            die("Get_file", "bad compressed frame");
+        if (rawlen == 0)
+            break;
+        if (Receive(fd, payload, complen) != 0 ||
+            frame_decode(payload, complen, rawlen, raw) < 0)
+            die("Get_file", "bad compressed frame");
+        if (fwrite(raw, 1, rawlen, fp) != rawlen)
+            die("Get_file write error", strerror(errno));
+        hash_update(md5, raw, rawlen);
+        size -= rawlen;
+    }
+    if (size != 0)
+        die("Get_file", "compressed file ended early");
+    free(payload);
+    free(raw);
+}
+
+/*
+ * receive_to_file() - receive size bytes from the server into a file, a
+ *                     buffer at a time.  With an offset, the bytes are
+ *                     written from there on, after what the file holds;
+ *                     otherwise the file is created anew.  Unless md5 is
+ *                     NULL, the whole file is hashed into it along the way.
+ *                     With deflate, the bytes arrive as compressed frames.
+ */
+void receive_to_file(int fd, char *save_name, long offset, long size,
+                     EVP_MD_CTX *md5, int deflate)
+{
+    FILE * fp = fopen(save_name, offset ? "r+b" : "wb");
+    if (fp == NULL)
+        die("Get_file file error", strerror(errno));
+    char buf[BUFSIZE];
+
+    /* what we already have counts towards the digest too */
+    for (long have = 0; md5 && have < offset; )
+    {
+        size_t len = offset - have < BUFSIZE ? offset - have : BUFSIZE;
+        if (fread(buf, 1, len, fp) != len)
+            die("Get_file file error", "local file shrank");
+        hash_update(md5, buf, len);
+        have += len;
+    }
+    if (fseek(fp, offset, SEEK_SET) < 0)
+        die("Get_file file error", strerror(errno));
+
+    if (deflate)
+    {
+        receive_frames(fd, fp, size, md5);
+        size = 0;
+    }
+    while (size > 0)
+    {
+        int len = size < BUFSIZE ? size : BUFSIZE;
+        if (Receive(fd, buf, len) != 0)
+            die("Get_file", "Connection closed while reading file");
+        if (fwrite(buf, 1, len, fp) != len)
+            die("Get_file write error", strerror(errno));
+        hash_update(md5, buf, len);
+        size -= len;
+    }
+    if (fclose(fp) != 0)
+        die("Get_file write error", strerror(errno));
+}
+
+/*
+ * receive_get_response() - read the server's answer to a GET from offset,
+ *                          and save the file according to the save_name.
+ *                          The file is written as it arrives, so a broken
+ *                          connection leaves behind as much as was received.
+ *                          With verify, the file is checked against the MD5
+ *                          the server sent, and unless md5 is NULL, that MD5
+ *                          is put there ("" if there was none).  Returns 1
+ *                          if the server said our copy is current, else 0.
+ */
+int receive_get_response(int fd, char *get_name, char *save_name, long offset,
+                         int verify, char *md5_out) 
+{
     /* get size of header */
     uint32_t header_size = Receive_Int(fd);
 
     /* get header */
-    char header_buf[header_size];
-    bzero(header_buf, header_size);
+    char header_buf[header_size + 1];
+    bzero(header_buf, header_size + 1);
 
     /* get response */
     if (Receive(fd, header_buf, header_size) != 0)
         die("Get_file", "Connection closed while reading header");
 
     /* check for OK */
-    char * iter_buf = strtok(header_buf, "\n");
-    if (strcmp(iter_buf, "OK"))
-        die("Get_file server response error", iter_buf);
+    char *saveptr;
+    char * iter_buf = strtok_r(header_buf, "\n", &saveptr);
+    if (iter_buf && strcmp(iter_buf, "NOT MODIFIED") == 0)
+        return 1;
+    if (iter_buf == NULL || strcmp(iter_buf, "OK"))
+        die("Get_file server response error", iter_buf ? iter_buf : "");
     
     /* check to make sure correct file was sent */
-    iter_buf = strtok(NULL, "\n");
-    if (strcmp(iter_buf, get_name))
+    iter_buf = strtok_r(NULL, "\n", &saveptr);
+    if (iter_buf == NULL || strcmp(iter_buf, get_name))
         die("Get_file file error", "Incorrect file retrieved");
 
     /* check file size */
-    char * t;
-    iter_buf = strtok(NULL, "\n");
-    int file_size = strtol(iter_buf, &t, 10);
-
-    /* create new buffer for file content */
-    char file_buf[file_size];
-    bzero(file_buf, file_size);
-    if (Receive(fd, file_buf, file_size) != 0)
-        die("Get_file", "Connection closed while reading file");
-
-    FILE * fp = fopen(save_name, "wb");
-    fwrite(file_buf, sizeof(file_buf), 1, fp);
+    iter_buf = strtok_r(NULL, "\n", &saveptr);
+    if (iter_buf == NULL)
+        die("Get_file server response error", "missing file size");
+    long file_size = atol(iter_buf);
+
+    /* then optional lines: where a resumed GET's bytes belong, and the MD5
+       of the whole file */
+    long range_offset = 0, total;
+    char *digest = NULL;
+    int deflate = 0;
+    while ((iter_buf = strtok_r(NULL, "\n", &saveptr)) != NULL)
+    {
+        if (strncmp(iter_buf, "Range ", 6) == 0 &&
+            sscanf(iter_buf, "Range %ld %ld", &range_offset, &total) != 2)
+            die("Get_file server response error", "malformed Range");
+        if (strncmp(iter_buf, "MD5 ", 4) == 0)
+            digest = iter_buf + 4;
+        if (strcmp(iter_buf, "Compress deflate") == 0)
+            deflate = 1;
+    }
+    if (range_offset != offset)
+        die("Get_file server response error", "wrong Range");
+    if (verify && digest == NULL)
+        fprintf(stderr, "Get_file: server sent no MD5; "
+                        "transfer not verified\n");
+
+    EVP_MD_CTX *md5 = verify && digest ? hash_begin(EVP_md5()) : NULL;
+    receive_to_file(fd, save_name, offset, file_size, md5, deflate);
+    char hex[MD5_HEX_LEN + 1];
+    if (md5 && (hash_end(md5, hex) < 0 || strcasecmp(hex, digest)))
+        die("Get_file", "MD5 mismatch; file corrupted in transfer");
+    if (md5_out)
+        strcpy(md5_out, digest && strlen(digest) == MD5_HEX_LEN ? digest : "");
+    return 0;
+}
+
+/*
+ * One file transfer, named on the command line or in a manifest
+ */
+struct op {
+    char *put_name;
+    char *get_name;
+    char *save_name;
+    int   batch;        /* transfers, starting with this one, in its request */
+    long  offset;       /* for a resumed GET, bytes already saved */
+    char  digest[MD5_HEX_LEN + 1];  /* for a verified PUT, the file's MD5 */
+};
+
+/*
+ * The list of transfers to perform
+ */
+struct op *ops = NULL;
+int nops = 0;
+
+/*
+ * add_op() - append a transfer to the list
+ */
+struct op *add_op(char *put_name, char *get_name)
+{
+    static int capacity = 0;
+    if (nops == capacity)
+    {
+        capacity = capacity ? capacity * 2 : 16;
+        if ((ops = realloc(ops, capacity * sizeof(*ops))) == NULL)
+            die("Out of memory", "too many transfers");
+    }
+    ops[nops] = (struct op){ .put_name = put_name, .get_name = get_name,
+                             .batch = 1 };
+    return &ops[nops++];
+}
+
+/*
+ * read_manifest() - add the transfers listed in a file, one per line:
+ *                   "PUT name" or "GET name [save_name]".  Blank lines and
+ *                   lines starting with '#' are skipped.
+ */
+void read_manifest(char *manifest)
+{
+    FILE * fp = fopen(manifest, "r");
+    if (fp == NULL)
+        die("Manifest file error", strerror(errno));
+    char *line = NULL;
+    size_t cap = 0;
+    int lineno = 0;
+    while (getline(&line, &cap, fp) != -1)
+    {
+        lineno++;
+        char *saveptr;
+        char *type = strtok_r(line, " \t\r\n", &saveptr);
+        if (type == NULL || type[0] == '#')
+            continue;
+        char *name = strtok_r(NULL, " \t\r\n", &saveptr);
+        char *save = strtok_r(NULL, " \t\r\n", &saveptr);
+        if (name == NULL)
+            type = "";
+        if (strcmp(type, "PUT") == 0)
+            add_op(strdup(name), NULL);
+        else if (strcmp(type, "GET") == 0)
+            add_op(NULL, strdup(name))->save_name = save ? strdup(save) : NULL;
+        else
+        {
+            char errbuf[256];
+            snprintf(errbuf, sizeof(errbuf), "%s line %d", manifest, lineno);
+            die("Manifest syntax error", errbuf);
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+/*
+ * save_name() - where a GET should store its file
+ */
+char *save_name(struct op *op)
+{
+    return op->save_name ? op->save_name : op->get_name;
+}
+
+/*
+ * What the client remembers about files it has fetched, so that a GET can
+ * ask for a file only if it has changed: the MD5 the server reported, and
+ * the size and modification time of the saved copy, so that a copy changed
+ * locally since is fetched again.  Kept in a file, one tab-separated line
+ * per copy: md5, size, mtime in nanoseconds, server, name, save name.
+ */
+struct meta {
+    char     *server;       /* "host:port" */
+    char     *name;
+    char     *save;
+    char      md5[MD5_HEX_LEN + 1];
+    long      size;
+    long long mtime;
+};
+
+/*
+ * The metadata file, if any, its contents, and the server they concern
+ */
+char *meta_path = NULL;
+struct meta *metas = NULL;
+int nmetas = 0;
+char *meta_server = NULL;
+
+/*
+ * meta_find() - the entry for a file saved from this server, or NULL
+ */
+struct meta *meta_find(char *name, char *save)
+{
+    for (int i = 0; i < nmetas; i++)
+        if (!strcmp(metas[i].server, meta_server) &&
+            !strcmp(metas[i].name, name) && !strcmp(metas[i].save, save))
+            return &metas[i];
+    return NULL;
+}
+
+/*
+ * meta_add() - append an entry, taking over its strings
+ */
+struct meta *meta_add(char *server, char *name, char *save)
+{
+    static int capacity = 0;
+    if (nmetas == capacity)
+    {
+        capacity = capacity ? capacity * 2 : 16;
+        if ((metas = realloc(metas, capacity * sizeof(*metas))) == NULL)
+            die("Out of memory", "too many remembered files");
+    }
+    metas[nmetas] = (struct meta){ .server = server, .name = name,
+                                   .save = save };
+    return &metas[nmetas++];
+}
+
+/*
+ * meta_save() - write the metadata file back out, replacing it whole
+ */
+void meta_save(void)
+{
+    char tmp[strlen(meta_path) + 8];
+    sprintf(tmp, "%s.tmp", meta_path);
+    FILE * fp = fopen(tmp, "w");
+    if (fp == NULL)
+        return;
+    for (int i = 0; i < nmetas; i++)
+        fprintf(fp, "%s\t%ld\t%lld\t%s\t%s\t%s\n", metas[i].md5,
+                metas[i].size, metas[i].mtime, metas[i].server,
+                metas[i].name, metas[i].save);
+    if (fclose(fp) != 0 || rename(tmp, meta_path) < 0)
+        unlink(tmp);
+}
+
+/*
+ * meta_load() - read the metadata file, if it exists, and save it again
+ *               when the program exits
+ */
+void meta_load(char *path)
+{
+    meta_path = path;
+    atexit(meta_save);
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL)
+        return;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, fp) != -1)
+    {
+        char *field[6], *saveptr;
+        int n = 0;
+        for (char *f = strtok_r(line, "\t\n", &saveptr); f && n < 6;
+             f = strtok_r(NULL, "\t\n", &saveptr))
+            field[n++] = f;
+        if (n < 6 || strlen(field[0]) != MD5_HEX_LEN)
+            continue;
+        struct meta *m = meta_add(strdup(field[3]), strdup(field[4]),
+                                  strdup(field[5]));
+        strcpy(m->md5, field[0]);
+        m->size = atol(field[1]);
+        m->mtime = atoll(field[2]);
+    }
+    free(line);
     fclose(fp);
 }
 
 /*
- * main() - parse command line, open a socket, transfer a file
+ * meta_token() - the MD5 to offer the server for a GET, if the saved copy
+ *                is still as it was when fetched; otherwise NULL
+ */
+char *meta_token(struct op *op)
+{
+    struct stat st;
+    struct meta *m;
+    if (meta_path == NULL ||
+        (m = meta_find(op->get_name, save_name(op))) == NULL ||
+        stat(save_name(op), &st) < 0 || st.st_size != m->size ||
+        st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec != m->mtime)
+        return NULL;
+    return m->md5;
+}
+
+/*
+ * meta_record() - remember the MD5 of a copy just saved
+ */
+void meta_record(struct op *op, char *md5)
+{
+    struct stat st;
+    if (meta_path == NULL || stat(save_name(op), &st) < 0)
+        return;
+    struct meta *m = meta_find(op->get_name, save_name(op));
+    if (m == NULL)
+        m = meta_add(strdup(meta_server), strdup(op->get_name),
+                     strdup(save_name(op)));
+    strcpy(m->md5, md5);
+    m->size = st.st_size;
+    m->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+/*
+ * batch_gets() - let each run of consecutive GETs share MGET requests, as
+ *                large as the server will take
+ */
+void batch_gets(void)
+{
+    for (int i = 0; i < nops; i += ops[i].batch)
+    {
+        size_t header_size = strlen("MGET\n");
+        int n = 0;
+        while (i + n < nops && ops[i + n].get_name && n < MGET_MAX &&
+               header_size + strlen(ops[i + n].get_name) + 1 <= MAX_HEADER)
+        {
+            header_size += strlen(ops[i + n].get_name) + 1;
+            n++;
+        }
+        if (n > 1)
+            ops[i].batch = n;
+    }
+}
+
+/*
+ * send_mget_request() - ask the server for n files in one request
+ */
+void send_mget_request(int fd, struct op *op, int n)
+{
+    uint32_t request_size = strlen("MGET\n");
+    for (int i = 0; i < n; i++)
+        request_size += strlen(op[i].get_name) + 1;
+    char mget[request_size + 1];
+    strcpy(mget, "MGET\n");
+    for (int i = 0; i < n; i++)
+    {
+        strcat(mget, op[i].get_name);
+        strcat(mget, "\n");
+    }
+    Send_Request(fd, mget, request_size, NULL, 0);
+}
+
+/*
+ * receive_mget_response() - read the server's answer to an MGET of n files,
+ *                           saving each one that it found
+ */
+void receive_mget_response(int fd, struct op *op, int n)
+{
+    uint32_t header_size = Receive_Int(fd);
+    char header_buf[header_size + 1];
+    bzero(header_buf, header_size + 1);
+    if (Receive(fd, header_buf, header_size) != 0)
+        die("Get_file", "Connection closed while reading header");
+
+    /* check for OK and the file count */
+    char *saveptr;
+    char *iter_buf = strtok_r(header_buf, "\n", &saveptr);
+    if (iter_buf == NULL || strcmp(iter_buf, "OK"))
+        die("Get_file server response error", iter_buf ? iter_buf : "");
+    iter_buf = strtok_r(NULL, "\n", &saveptr);
+    if (iter_buf == NULL || atoi(iter_buf) != n)
+        die("Get_file server response error", "wrong number of files");
+
+    /* one "<status> <size> <name>" line per file, then the bodies */
+    long sizes[n];
+    for (int i = 0; i < n; i++)
+    {
+        char status[16];
+        iter_buf = strtok_r(NULL, "\n", &saveptr);
+        if (iter_buf == NULL ||
+            sscanf(iter_buf, "%15s %ld", status, &sizes[i]) != 2)
+            die("Get_file server response error", "malformed MGET header");
+        if (strcmp(status, "OK"))
+        {
+            fprintf(stderr, "Get_file %s: %s\n", op[i].get_name, status);
+            sizes[i] = -1;
+        }
+    }
+    for (int i = 0; i < n; i++)
+        if (sizes[i] >= 0)
+            receive_to_file(fd, save_name(&op[i]), 0, sizes[i], NULL, 0);
+}
+
+/*
+ * How many connections to split a large transfer across
+ */
+int nstreams = 1;
+
+/*
+ * Whether a GET should pick up where a partial local copy left off
+ */
+int resume = 0;
+
+/*
+ * Whether to check every PUT and GET against the server's MD5
+ */
+int verify = 0;
+
+/*
+ * Whether to compress file contents on the wire
+ */
+int compressed = 0;
+
+/*
+ * resume_offset() - how much of a GET's file is already saved locally, and
+ *                   need not be fetched again
+ */
+long resume_offset(struct op *op)
+{
+    struct stat st;
+    if (!resume || stat(save_name(op), &st) < 0 || !S_ISREG(st.st_mode))
+        return 0;
+    return st.st_size;
+}
+
+/*
+ * send_request() / receive_response() - the two halves of a transfer, or
+ *                                       of a batch of GETs
+ */
+void send_request(int fd, struct op *op)
+{
+    if (op->put_name)
+        send_put_request(fd, op->put_name, verify ? op->digest : NULL,
+                         compressed);
+    else if (op->batch > 1)
+        send_mget_request(fd, op, op->batch);
+    else
+    {
+        /* a partial copy can't be current, so it never offers a token */
+        op->offset = resume_offset(op);
+        send_get_request(fd, op->get_name, op->offset, verify || meta_path,
+                         op->offset ? NULL : meta_token(op), compressed);
+    }
+}
+
+void receive_response(int fd, struct op *op)
+{
+    if (op->put_name)
+        receive_put_response(fd, verify ? op->digest : NULL);
+    else if (op->batch > 1)
+        receive_mget_response(fd, op, op->batch);
+    else
+    {
+        char md5[MD5_HEX_LEN + 1];
+        if (receive_get_response(fd, op->get_name, save_name(op), op->offset,
+                                 verify, md5) == 0 && md5[0])
+            meta_record(op, md5);
+    }
+}
+
+/*
+ * close_connection() - close a socket, or terminate the program
+ */
+void close_connection(int fd)
+{
+    if (close(fd) < 0)
+        die("Close error: ", strerror(errno));
+}
+
+/*
+ * One byte range of a file, moved over a connection of its own
+ */
+struct stream {
+    char     *server;
+    int       port;
+    char     *name;         /* file on the server */
+    int       fd;           /* local file, shared by every stream */
+    long      offset;
+    long      length;
+    long      total;        /* size of the whole file */
+    pthread_t thread;
+};
+
+/*
+ * get_range() - fetch one stream's range of a file into the local file
+ */
+void *get_range(void *arg)
+{
+    struct stream *st = arg;
+    int fd = connect_to_server(st->server, st->port);
+
+    char request[strlen(st->name) + 64];
+    uint32_t request_size = sprintf(request, "GET\n%s\nRange %ld %ld\n",
+                                    st->name, st->offset, st->length);
+    Send_Request(fd, request, request_size, NULL, 0);
+
+    /* the server answers with exactly the range, and the size it has */
+    uint32_t header_size = Receive_Int(fd);
+    char header_buf[header_size + 1];
+    bzero(header_buf, header_size + 1);
+    if (Receive(fd, header_buf, header_size) != 0)
+        die("Get_file", "Connection closed while reading header");
+    char *saveptr;
+    char *iter_buf = strtok_r(header_buf, "\n", &saveptr);
+    if (iter_buf == NULL || strcmp(iter_buf, "OK"))
+        die("Get_file server response error", iter_buf ? iter_buf : "");
+    strtok_r(NULL, "\n", &saveptr);
+    char *size_str = strtok_r(NULL, "\n", &saveptr);
+    char *range = strtok_r(NULL, "\n", &saveptr);
+    long length, offset, total;
+    if (size_str == NULL || range == NULL ||
+        sscanf(range, "Range %ld %ld", &offset, &total) != 2)
+        die("Get_file server response error", "malformed ranged GET header");
+    length = atol(size_str);
+    if (offset != st->offset || length != st->length || total != st->total)
+        die("Get_file", "file changed on the server during the transfer");
+
+    char buf[BUFSIZE];
+    while (length > 0)
+    {
+        int len = length < BUFSIZE ? length : BUFSIZE;
+        if (Receive(fd, buf, len) != 0)
+            die("Get_file", "Connection closed while reading file");
+        if (pwrite(st->fd, buf, len, offset) != len)
+            die("Get_file write error", strerror(errno));
+        offset += len;
+        length -= len;
+    }
+    close_connection(fd);
+    return NULL;
+}
+
+/*
+ * put_range() - send one stream's range of the local file to the server
+ */
+void *put_range(void *arg)
+{
+    struct stream *st = arg;
+    int fd = connect_to_server(st->server, st->port);
+
+    char request[strlen(st->name) + 96];
+    uint32_t request_size = sprintf(request, "PUT\n%s\n%ld\nRange %ld %ld\n",
+                                    st->name, st->length, st->offset,
+                                    st->total);
+    Send_Request(fd, request, request_size, NULL, 0);
+
+    off_t offset = st->offset;
+    long length = st->length;
+    while (length > 0)
+    {
+        ssize_t n = sendfile(fd, st->fd, &offset, length);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            die("Put_file write error", n ? strerror(errno) : "file shrank");
+        }
+        length -= n;
+    }
+    receive_put_response(fd, NULL);
+    close_connection(fd);
+    return NULL;
+}
+
+/*
+ * run_streams() - split size bytes into ranges for up to nstreams threads,
+ *                 and wait for them all
+ */
+void run_streams(char *server, int port, char *name, int fd, long size,
+                 void *(*fn)(void *))
+{
+    int n = size / STREAM_MIN < nstreams ? size / STREAM_MIN : nstreams;
+    if (n < 1)
+        n = 1;
+    struct stream streams[n];
+    long share = size / n;
+    for (int i = 0; i < n; i++)
+    {
+        streams[i] = (struct stream){ .server = server, .port = port,
+                                      .name = name, .fd = fd,
+                                      .offset = i * share, .length = share,
+                                      .total = size };
+        if (i == n - 1)
+            streams[i].length = size - i * share;
+        if ((errno = pthread_create(&streams[i].thread, NULL, fn,
+                                    &streams[i])) != 0)
+            die("Thread error", strerror(errno));
+    }
+    for (int i = 0; i < n; i++)
+        pthread_join(streams[i].thread, NULL);
+}
+
+/*
+ * get_parallel() - fetch a file over several connections, and check it
+ *                  against the MD5 the server reports
+ */
+void get_parallel(char *server, int port, struct op *op)
+{
+    char *get_name = op->get_name, *save = save_name(op);
+    /* learn the file's size and digest */
+    int fd = connect_to_server(server, port);
+    uint32_t request_size = strlen("SUM\n") + strlen(get_name) + 1;
+    char request[request_size + 1];
+    sprintf(request, "SUM\n%s\n", get_name);
+    Send_Request(fd, request, request_size, NULL, 0);
+    uint32_t header_size = Receive_Int(fd);
+    char header_buf[header_size + 1];
+    bzero(header_buf, header_size + 1);
+    if (Receive(fd, header_buf, header_size) != 0)
+        die("Get_file", "Connection closed while reading header");
+    close_connection(fd);
+
+    char *saveptr;
+    char *iter_buf = strtok_r(header_buf, "\n", &saveptr);
+    if (iter_buf == NULL || strcmp(iter_buf, "OK"))
+        die("Get_file server response error", iter_buf ? iter_buf : "");
+    iter_buf = strtok_r(NULL, "\n", &saveptr);
+    char *size_str = strtok_r(NULL, "\n", &saveptr);
+    char *digest = strtok_r(NULL, "\n", &saveptr);
+    if (iter_buf == NULL || strcmp(iter_buf, get_name) || size_str == NULL ||
+        digest == NULL)
+        die("Get_file server response error", "malformed SUM header");
+    long size = atol(size_str);
+
+    /* nothing to do if our copy is current */
+    char *token = meta_token(op);
+    if (token && strcasecmp(token, digest) == 0)
+        return;
+
+    /* every stream writes its own part of the file */
+    int file = open(save, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (file < 0 || ftruncate(file, size) < 0)
+        die("Get_file file error", strerror(errno));
+    run_streams(server, port, get_name, file, size, get_range);
+
+    char hex[MD5_HEX_LEN + 1];
+    if (hash_fd(file, size, EVP_md5(), hex) < 0)
+        die("Get_file file error", strerror(errno));
+    if (strcasecmp(hex, digest))
+        die("Get_file", "MD5 mismatch; file corrupted in transfer");
+    if (close(file) < 0)
+        die("Get_file write error", strerror(errno));
+    meta_record(op, hex);
+}
+
+/*
+ * put_parallel() - send a file over several connections, then have the
+ *                  server check its MD5 and put it in place
+ */
+void put_parallel(char *server, int port, char *put_name)
+{
+    int file = open(put_name, O_RDONLY);
+    struct stat st;
+    char hex[MD5_HEX_LEN + 1];
+    if (file < 0 || fstat(file, &st) < 0)
+        die("Put_file file error", "file not found");
+    if (hash_fd(file, st.st_size, EVP_md5(), hex) < 0)
+        die("Put_file file error", strerror(errno));
+    run_streams(server, port, put_name, file, st.st_size, put_range);
+    close(file);
+
+    int fd = connect_to_server(server, port);
+    char request[strlen(put_name) + 96];
+    uint32_t request_size = sprintf(request, "COMMIT\n%s\n%ld\n%s\n",
+                                    put_name, (long)st.st_size, hex);
+    Send_Request(fd, request, request_size, NULL, 0);
+    receive_put_response(fd, NULL);
+    close_connection(fd);
+}
+
+/*
+ * Whether to offer the server each PUT's SHA-256 first, and upload only
+ * content it doesn't already have
+ */
+int dedup = 0;
+
+/*
+ * put_dedup() - have the server link a file to content it already stores,
+ *               and upload the file only if it can't
+ */
+void put_dedup(char *server, int port, char *put_name)
+{
+    int file = open(put_name, O_RDONLY);
+    struct stat st;
+    char hex[SHA256_HEX_LEN + 1];
+    if (file < 0 || fstat(file, &st) < 0)
+        die("Put_file file error", "file not found");
+    if (hash_fd(file, st.st_size, EVP_sha256(), hex) < 0)
+        die("Put_file file error", strerror(errno));
+    close(file);
+
+    int fd = connect_to_server(server, port);
+    char request[strlen(put_name) + 96];
+    uint32_t request_size = sprintf(request, "LINK\n%s\n%s\n", put_name, hex);
+    Send_Request(fd, request, request_size, NULL, 0);
+    uint32_t rec_size = Receive_Int(fd);
+    char response[rec_size + 1];
+    bzero(response, rec_size + 1);
+    if (Receive(fd, response, rec_size) != 0)
+        die("Put_file", "Connection closed while reading response");
+    close_connection(fd);
+    if (strncmp(response, "OK\n", 3) == 0)
+        return;
+    if (strncmp(response, "MISSING\n", 8))
+        die("Put_file server response error", response);
+
+    /* the server needs the bytes after all */
+    if (nstreams > 1 && st.st_size >= 2 * STREAM_MIN)
+    {
+        put_parallel(server, port, put_name);
+        return;
+    }
+    char digest[MD5_HEX_LEN + 1];
+    fd = connect_to_server(server, port);
+    send_put_request(fd, put_name, verify ? digest : NULL, compressed);
+    receive_put_response(fd, verify ? digest : NULL);
+    close_connection(fd);
+}
+
+/*
+ * is_separate() - whether a transfer needs connections of its own: any
+ *                 PUT that offers its hash first, any single GET that is
+ *                 not being resumed when splitting transfers (only the
+ *                 server knows how large it is), and any PUT large enough
+ *                 to split
+ */
+int is_separate(struct op *op)
+{
+    struct stat st;
+    if (op->put_name && dedup)
+        return 1;
+    if (nstreams < 2 || op->batch > 1)
+        return 0;
+    if (op->get_name)
+        return !resume;
+    return stat(op->put_name, &st) == 0 && st.st_size >= 2 * STREAM_MIN;
+}
+
+/*
+ * transfer_separately() - perform a transfer for which is_separate() is
+ *                         true
+ */
+void transfer_separately(char *server, int port, struct op *op)
+{
+    if (op->put_name && dedup)
+        put_dedup(server, port, op->put_name);
+    else if (op->put_name)
+        put_parallel(server, port, op->put_name);
+    else
+        get_parallel(server, port, op);
+}
+
+/*
+ * run_pipelined() - perform every transfer over one connection, keeping up
+ *                   to window requests in flight, and reading the responses
+ *                   in order.  A PUT is held back while GET responses are
+ *                   outstanding: the server may be blocked writing a file to
+ *                   us, and would never read the PUT body we are writing.
+ *                   Transfers that need connections of their own wait
+ *                   for the pipeline to drain, to keep everything in order.
+ */
+void run_pipelined(char *server, int port, int fd, int window)
+{
+    int sent = 0, done = 0, in_flight = 0, gets_pending = 0;
+    while (done < nops)
+    {
+        if (done == sent && is_separate(&ops[sent]))
+        {
+            transfer_separately(server, port, &ops[sent]);
+            sent = ++done;
+            continue;
+        }
+        while (sent < nops && in_flight < window && !is_separate(&ops[sent]) &&
+               (ops[sent].get_name || gets_pending == 0))
+        {
+            if (ops[sent].get_name)
+                gets_pending++;
+            in_flight++;
+            send_request(fd, &ops[sent]);
+            sent += ops[sent].batch;
+        }
+        if (ops[done].get_name)
+            gets_pending--;
+        in_flight--;
+        receive_response(fd, &ops[done]);
+        done += ops[done].batch;
+    }
+}
+
+/*
+ * print_stats() - ask the server for its counters and latencies, and print
+ *                 them
+ */
+void print_stats(char *server, int port)
+{
+    int fd = connect_to_server(server, port);
+    Send_Request(fd, "STATS\n", strlen("STATS\n"), NULL, 0);
+    uint32_t size = Receive_Int(fd);
+    char response[size + 1];
+    bzero(response, size + 1);
+    if (Receive(fd, response, size) != 0)
+        die("Stats", "Connection closed while reading response");
+    if (strncmp(response, "OK\n", 3))
+        die("Stats server response error", response);
+    printf("%s", response + 3);
+    close_connection(fd);
+}
+
+/*
+ * main() - parse command line, open a socket, transfer files
  */
 int main(int argc, char **argv) {
     /* for getopt */
     long  opt;
     char *server = NULL;
-    char *put_name = NULL;
-    char *get_name = NULL;
     int   port;
-    char *save_name = NULL;
+    int   keepalive = 0;
+    int   window = 1;
+    int   batch = 0;
+    int   stats = 0;
 
     check_team(argv[0]);
 
     /* parse the command-line options. */
-    while ((opt = getopt(argc, argv, "hs:P:G:S:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "hs:P:G:S:p:km:w:Mn:rdDc:zT")) != -1) {
         switch(opt) {
           case 'h': help(argv[0]); break;
           case 's': server = optarg; break;
-          case 'P': put_name = optarg; break;
-          case 'G': get_name = optarg; break;
-          case 'S': save_name = optarg; break;
+          case 'P': add_op(optarg, NULL); break;
+          case 'G': add_op(NULL, optarg); break;
+          case 'S':
+            if (nops == 0 || ops[nops - 1].get_name == NULL)
+                die("Usage error", "-S must follow a -G");
+            ops[nops - 1].save_name = optarg;
+            break;
           case 'p': port = atoi(optarg); break;
+          case 'k': keepalive = 1; break;
+          case 'm': read_manifest(optarg); break;
+          case 'w': window = atoi(optarg); break;
+          case 'M': batch = 1; break;
+          case 'n': nstreams = atoi(optarg); break;
+          case 'r': resume = 1; break;
+          case 'd': verify = 1; break;
+          case 'D': dedup = 1; break;
+          case 'c': meta_load(optarg); break;
+          case 'z': compressed = 1; break;
+          case 'T': stats = 1; break;
         }
     }
+    if (window < 1)
+        window = 1;
+    /* an MGET moves whole files as they are, with no MD5, compression,
+       token or offset, so GETs that need any of those stay separate */
+    if (batch && !verify && !compressed && !meta_path && !resume)
+        batch_gets();
+    if (stats)
+        print_stats(server, port);
+    if (meta_path && asprintf(&meta_server, "%s:%d", server, port) < 0)
+        die("Out of memory", "metadata");
 
-    /* open a connection to the server */
-    int fd = connect_to_server(server, port);
-    /* put or get, as appropriate */
-    if (put_name)
-        put_file(fd, put_name);
-    else
-        get_file(fd, get_name, save_name);
+    /* with keep-alive, one connection carries every transfer */
+    if (keepalive) {
+        int fd = connect_to_server(server, port);
+        run_pipelined(server, port, fd, window);
+        close_connection(fd);
+        exit(0);
+    }
 
-    /* close the socket */
-    int rc;
-    if ((rc = close(fd)) < 0)
-        die("Close error: ", strerror(errno));
+    /* otherwise open a connection for each put or get */
+    for (int i = 0; i < nops; i += ops[i].batch) {
+        if (is_separate(&ops[i])) {
+            transfer_separately(server, port, &ops[i]);
+            continue;
+        }
+        int fd = connect_to_server(server, port);
+        send_request(fd, &ops[i]);
+        receive_response(fd, &ops[i]);
+        close_connection(fd);
+    }
     exit(0);
 }
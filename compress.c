@@ -0,0 +1,52 @@
+#include <string.h>
+#include <zlib.h>
+#include "compress.h"
+
+size_t frame_bound(size_t n) {
+    size_t bound = compressBound(n);
+    return FRAME_HDR + (bound > n ? bound : n);
+}
+
+size_t frame_encode(const void *raw, size_t n, void *out) {
+    uint32_t lens[2] = { 0, n };
+    uLongf complen = compressBound(n);
+    char *payload = (char *)out + FRAME_HDR;
+
+    /* favour speed: the point is to beat the network, not to win prizes */
+    if (compress2((Bytef *)payload, &complen, raw, n, Z_BEST_SPEED) != Z_OK ||
+        complen >= n) {
+        memcpy(payload, raw, n);
+        complen = n;
+    }
+    lens[0] = complen;
+    memcpy(out, lens, FRAME_HDR);
+    return FRAME_HDR + complen;
+}
+
+size_t frame_end(void *out) {
+    memset(out, 0, FRAME_HDR);
+    return FRAME_HDR;
+}
+
+int frame_header(const void *hdr, uint32_t *complen, uint32_t *rawlen) {
+    uint32_t lens[2];
+    memcpy(lens, hdr, FRAME_HDR);
+    *complen = lens[0];
+    *rawlen = lens[1];
+    if (*rawlen > FRAME_RAW_MAX || *complen > frame_bound(*rawlen) ||
+        (*complen == 0) != (*rawlen == 0))
+        return -1;
+    return 0;
+}
+
+int frame_decode(const void *payload, uint32_t complen, uint32_t rawlen,
+                 void *out) {
+    if (complen == rawlen) {
+        memcpy(out, payload, rawlen);
+        return 0;
+    }
+    uLongf len = rawlen;
+    if (uncompress(out, &len, payload, complen) != Z_OK || len != rawlen)
+        return -1;
+    return 0;
+}
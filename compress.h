@@ -0,0 +1,53 @@
+#ifndef COMPRESS_H__
+#define COMPRESS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The framing for compressed bodies, shared by the client and the server.
+ * A request or response that says "Compress deflate" sends its body as a
+ * series of frames, each compressed on its own so that either end can work
+ * a chunk at a time: a 32-bit compressed length, a 32-bit raw length, and
+ * the zlib-compressed bytes.  A chunk that doesn't shrink is sent as is,
+ * with both lengths equal.  A frame with both lengths 0 ends the body.
+ */
+
+/* Most raw bytes in one frame, and the size of a frame's header */
+#define FRAME_RAW_MAX 65536
+#define FRAME_HDR     8
+
+/*
+ * frame_bound() - the most bytes a frame of up to n raw bytes can take,
+ *                 header included
+ */
+size_t frame_bound(size_t n);
+
+/*
+ * frame_encode() - compress n raw bytes, at most FRAME_RAW_MAX, into one
+ *                  frame at out, which must hold frame_bound(n) bytes.
+ *                  Returns the length of the frame.
+ */
+size_t frame_encode(const void *raw, size_t n, void *out);
+
+/*
+ * frame_end() - write the frame that ends a body to out.  Returns its
+ *               length.
+ */
+size_t frame_end(void *out);
+
+/*
+ * frame_header() - read a frame header.  Returns 0, or -1 if it can't be
+ *                  valid.
+ */
+int frame_header(const void *hdr, uint32_t *complen, uint32_t *rawlen);
+
+/*
+ * frame_decode() - expand the complen bytes after a frame's header into
+ *                  its rawlen bytes at out.  Returns 0, or -1 if they are
+ *                  corrupt.
+ */
+int frame_decode(const void *payload, uint32_t complen, uint32_t rawlen,
+                 void *out);
+
+#endif
@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include "digest.h"
+
+/* The extended attribute holding "<size> <mtime sec> <mtime nsec> <md5>" */
+#define DIGEST_XATTR "user.md5"
+
+EVP_MD_CTX *hash_begin(const EVP_MD *md) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx && !EVP_DigestInit_ex(ctx, md, NULL)) {
+        EVP_MD_CTX_free(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+void hash_update(EVP_MD_CTX *ctx, const void *data, size_t len) {
+    if (ctx)
+        EVP_DigestUpdate(ctx, data, len);
+}
+
+int hash_end(EVP_MD_CTX *ctx, char *hex) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+    if (ctx == NULL)
+        return -1;
+    int ok = EVP_DigestFinal_ex(ctx, md, &mdlen);
+    EVP_MD_CTX_free(ctx);
+    if (!ok)
+        return -1;
+    for (unsigned int i = 0; i < mdlen; i++)
+        sprintf(hex + 2 * i, "%02x", md[i]);
+    return 0;
+}
+
+int hash_fd(int fd, off_t size, const EVP_MD *md, char *hex) {
+    char buf[65536];
+    off_t offset = 0;
+
+    EVP_MD_CTX *ctx = hash_begin(md);
+    if (ctx == NULL)
+        return -1;
+    while (offset < size) {
+        size_t want = size - offset < (off_t)sizeof(buf) ? size - offset
+                                                         : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            EVP_MD_CTX_free(ctx);
+            return -1;
+        }
+        hash_update(ctx, buf, n);
+        offset += n;
+    }
+    return hash_end(ctx, hex);
+}
+
+int digest_load(int fd, const struct stat *st, char *hex) {
+    char value[128];
+    long long size, sec, nsec;
+    ssize_t len = fgetxattr(fd, DIGEST_XATTR, value, sizeof(value) - 1);
+    if (len < 0)
+        return -1;
+    value[len] = '\0';
+    if (sscanf(value, "%lld %lld %lld %32s", &size, &sec, &nsec, hex) != 4 ||
+        strlen(hex) != MD5_HEX_LEN || size != st->st_size ||
+        sec != st->st_mtim.tv_sec || nsec != st->st_mtim.tv_nsec)
+        return -1;
+    return 0;
+}
+
+void digest_store(int fd, const char *hex) {
+    char value[128];
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return;
+    int len = snprintf(value, sizeof(value), "%lld %lld %lld %s",
+                       (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+                       (long long)st.st_mtim.tv_nsec, hex);
+    fsetxattr(fd, DIGEST_XATTR, value, len, 0);
+}
@@ -0,0 +1,59 @@
+#ifndef DIGEST_H__
+#define DIGEST_H__
+
+#include <openssl/evp.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * Digest helpers shared by the client and the server, so that both ends of
+ * a transfer can check that they hold the same bytes.  Digests travel as
+ * lowercase hex.
+ */
+
+/* Characters in a hex MD5 or SHA-256 digest, not counting the NUL */
+#define MD5_HEX_LEN 32
+#define SHA256_HEX_LEN 64
+
+/*
+ * hash_begin() - start a digest, such as EVP_md5(), to be fed a piece at a
+ *                time as data streams past.  Returns NULL if OpenSSL can't
+ *                provide one.
+ */
+EVP_MD_CTX *hash_begin(const EVP_MD *md);
+
+/*
+ * hash_update() - add len bytes to a digest; a NULL ctx is ignored
+ */
+void hash_update(EVP_MD_CTX *ctx, const void *data, size_t len);
+
+/*
+ * hash_end() - finish a digest into hex, which must have room for it and a
+ *              NUL, and free ctx.  Returns 0, or -1 if ctx is NULL or a
+ *              step failed.
+ */
+int hash_end(EVP_MD_CTX *ctx, char *hex);
+
+/*
+ * hash_fd() - hash the first size bytes of a file into hex.  Returns 0, or
+ *             -1 if the file could not be read.
+ */
+int hash_fd(int fd, off_t size, const EVP_MD *md, char *hex);
+
+/*
+ * digest_load() - fetch the MD5 stored with a file by digest_store().
+ *                 Returns 0, or -1 if there is none, or if the file's size
+ *                 or modification time (given in st) have changed since.
+ */
+int digest_load(int fd, const struct stat *st, char *hex);
+
+/*
+ * digest_store() - record a file's MD5 in an extended attribute, with
+ *                  the size and modification time it belongs to.  Call it
+ *                  once the file is fully written.  Failure is harmless:
+ *                  the digest is simply computed again when next needed.
+ */
+void digest_store(int fd, const char *hex);
+
+#endif
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "durable.h"
+#include "stats.h"
+
+static const char *mode_names[DURABLE_NMODES] = { "none", "sync", "group" };
+
+static enum durability mode;
+
+/*
+ * The groups.  A file joins the group after the one being flushed, so that
+ * everything written through it before it joined is written out by a flush
+ * that starts later.  Groups are numbered from 1; the members of the next
+ * one are known by a file on each of their filesystems, which its members
+ * keep open until it is flushed.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  joined;         /* the next group has a member */
+    pthread_cond_t  flushed;        /* a group has been flushed */
+    unsigned long   started;        /* groups the flusher has taken */
+    unsigned long   finished;       /* and flushed; read atomically */
+    unsigned long   failed;         /* the last that failed, or 0 */
+    size_t          members;        /* joins in the next group */
+    int             fds[DURABLE_FILESYSTEMS];
+    dev_t           devs[DURABLE_FILESYSTEMS];
+    int             nfs;
+    int             everything;     /* too many filesystems: sync() */
+    int            *watchers;       /* eventfds to tick after a flush */
+    int             nwatchers;
+} group = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .joined = PTHREAD_COND_INITIALIZER,
+    .flushed = PTHREAD_COND_INITIALIZER
+};
+
+int durable_parse(const char *name) {
+    for (int i = 0; i < DURABLE_NMODES; i++)
+        if (strcmp(name, mode_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+enum durability durable_mode(void) {
+    return mode;
+}
+
+/*
+ * flush() - make one group's filesystems durable.  Returns 0, or -1 on
+ *           failure.
+ */
+static int flush(const int *fds, int n, int everything) {
+    if (everything) {
+        sync();
+        return 0;
+    }
+    int rc = 0;
+    for (int i = 0; i < n; i++)
+        if (syncfs(fds[i]) < 0)
+            rc = -1;
+    return rc;
+}
+
+/*
+ * flusher() - flush each group as soon as it has members, one at a time
+ */
+static void *flusher(void *arg) {
+    pthread_mutex_lock(&group.lock);
+    while (1) {
+        while (group.members == 0)
+            pthread_cond_wait(&group.joined, &group.lock);
+        int fds[DURABLE_FILESYSTEMS], n = group.nfs;
+        int everything = group.everything;
+        size_t members = group.members;
+        memcpy(fds, group.fds, n * sizeof(int));
+        unsigned long g = ++group.started;
+        group.members = group.nfs = group.everything = 0;
+        pthread_mutex_unlock(&group.lock);
+
+        int rc = flush(fds, n, everything);
+        stats_group(members);
+
+        pthread_mutex_lock(&group.lock);
+        if (rc < 0)
+            group.failed = g;
+        __atomic_store_n(&group.finished, g, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&group.flushed);
+        uint64_t one = 1;
+        for (int i = 0; i < group.nwatchers; i++)
+            if (write(group.watchers[i], &one, sizeof(one)) < 0)
+                ;   /* only fails if the counter is full, which still wakes */
+    }
+    return NULL;
+}
+
+int durable_init(enum durability m) {
+    mode = m;
+    stats_durability(mode_names[m]);
+    if (mode != DURABLE_GROUP)
+        return 0;
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, flusher, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+int durable_join(const int *fds, int n, unsigned long *g) {
+    struct stat st[n];
+    for (int i = 0; i < n; i++)
+        if (fstat(fds[i], &st[i]) < 0)
+            return -1;
+
+    pthread_mutex_lock(&group.lock);
+    for (int i = 0; i < n; i++) {
+        int j = 0;
+        while (j < group.nfs && group.devs[j] != st[i].st_dev)
+            j++;
+        if (j < group.nfs)
+            continue;
+        if (group.nfs == DURABLE_FILESYSTEMS)
+            group.everything = 1;
+        else {
+            group.devs[group.nfs] = st[i].st_dev;
+            group.fds[group.nfs++] = fds[i];
+        }
+    }
+    group.members++;
+    *g = group.started + 1;
+    pthread_cond_signal(&group.joined);
+    pthread_mutex_unlock(&group.lock);
+    return 0;
+}
+
+int durable_done(unsigned long g) {
+    if (__atomic_load_n(&group.finished, __ATOMIC_ACQUIRE) < g)
+        return 0;
+    /* a failure may be reported to any later flush than the one that hit
+       it, so a group can't be sure of more than that none has failed since
+       it started */
+    pthread_mutex_lock(&group.lock);
+    int ok = group.failed < g;
+    pthread_mutex_unlock(&group.lock);
+    return ok ? 1 : -1;
+}
+
+int durable_sync(const int *fds, int n, int dirs) {
+    if (mode == DURABLE_GROUP) {
+        unsigned long g;
+        if (durable_join(fds, n, &g) < 0)
+            return -1;
+        pthread_mutex_lock(&group.lock);
+        while (group.finished < g)
+            pthread_cond_wait(&group.flushed, &group.lock);
+        pthread_mutex_unlock(&group.lock);
+        return durable_done(g) > 0 ? 0 : -1;
+    }
+    for (int i = 0; mode == DURABLE_SYNC && i < n; i++)
+        if ((dirs ? fsync(fds[i]) : fdatasync(fds[i])) < 0)
+            return -1;
+    return 0;
+}
+
+int durable_watch(int efd) {
+    pthread_mutex_lock(&group.lock);
+    int *w = realloc(group.watchers, (group.nwatchers + 1) * sizeof(int));
+    if (w) {
+        group.watchers = w;
+        group.watchers[group.nwatchers++] = efd;
+    }
+    pthread_mutex_unlock(&group.lock);
+    return w ? 0 : -1;
+}
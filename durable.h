@@ -0,0 +1,71 @@
+#ifndef DURABLE_H__
+#define DURABLE_H__
+
+/*
+ * How sure the server is that an upload will survive a crash before it
+ * says OK.  With DURABLE_NONE, an upload is acknowledged as soon as it has
+ * been renamed into place, and the kernel writes it out when it likes.
+ * The other modes make its data durable before the rename, so that a
+ * crash can never leave a name pointing at half a file, and then the
+ * directory entries that the rename changed, before acknowledging it.
+ *
+ * DURABLE_SYNC does that with an fdatasync() of the file and an fsync() of
+ * each directory, for every upload.  DURABLE_GROUP instead has uploads
+ * join a group, which one thread makes durable with a single syncfs() of
+ * each filesystem they are on.  While it does, the next group gathers, so
+ * under load many uploads share one flush, and the cost per upload falls
+ * as concurrency rises.  A syncfs() also writes out whatever else is dirty
+ * on the filesystem, so groups suit a server with its disk to itself.
+ */
+
+/* Filesystems one group may span before it falls back to sync() */
+#define DURABLE_FILESYSTEMS 8
+
+enum durability { DURABLE_NONE, DURABLE_SYNC, DURABLE_GROUP, DURABLE_NMODES };
+
+/*
+ * durable_parse() - the mode with this name ("none", "sync" or "group"),
+ *                   or -1 if there is none
+ */
+int durable_parse(const char *name);
+
+/*
+ * durable_init() - set how durable uploads are, starting the thread that
+ *                  flushes groups if there is to be one.  Returns 0, or -1
+ *                  on failure.
+ */
+int durable_init(enum durability mode);
+
+/*
+ * durable_mode() - the mode durable_init() set
+ */
+enum durability durable_mode(void);
+
+/*
+ * durable_sync() - make durable what has been written through n files, or
+ *                  with dirs, the entries of n directories, waiting until
+ *                  it is done.  Returns 0, or -1 on failure.
+ */
+int durable_sync(const int *fds, int n, int dirs);
+
+/*
+ * durable_join() - for DURABLE_GROUP, have n files or directories made
+ *                  durable by the next group, without waiting, and say
+ *                  which group that is.  Returns 0, or -1 on failure.
+ */
+int durable_join(const int *fds, int n, unsigned long *group);
+
+/*
+ * durable_done() - whether a group has been flushed: 1 if it has, 0 if not
+ *                  yet, or -1 if the flush failed
+ */
+int durable_done(unsigned long group);
+
+/*
+ * durable_watch() - write to eventfd efd each time a group is flushed, so
+ *                   that a thread that can't wait in durable_sync() can
+ *                   poll for it.  Returns 0, or -1 on failure.
+ */
+int durable_watch(int efd);
+
+#endif
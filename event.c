@@ -0,0 +1,1078 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "accesslog.h"
+#include "aio.h"
+#include "durable.h"
+#include "event.h"
+#include "request.h"
+#include "stats.h"
+
+/* How many ready connections one epoll_wait() may report */
+#define EV_MAXEVENTS 256
+
+/* PUT chunks one connection may have on their way to disk at once */
+#define EV_SPILLS 4
+
+/*
+ * A connection moves through these states once per request: read the 32-bit
+ * header length, read the header, read the body of a PUT, then write the
+ * response.  With keep-alive it then starts over on the next request.  With
+ * an aio, it may also stop in ST_DISK to wait for the disk: while a GET's
+ * file is read into the cache, while a PUT has as many chunks being
+ * written as it may, or until all of them are, and while a finished PUT,
+ * or what a COMMIT or LINK did, is made durable.  It stops there too
+ * while the aio's threads do what has
+ * no asynchronous form: build a response that reads files, send from a
+ * file, or create or rename a PUT's file.
+ */
+enum conn_state { ST_HDRLEN, ST_HEADER, ST_BODY, ST_DISK, ST_SEND };
+
+struct loop;
+
+struct conn {
+    struct loop    *loop;
+    int             fd;
+    struct sockaddr_in peer;        /* the client, for the access log */
+    enum conn_state state;
+    int             closing;        /* hang up once the response is out */
+    time_t          last;           /* when the connection last made progress */
+    struct conn    *prev;           /* the loop's list, least recently active */
+    struct conn    *next;           /* first */
+    uint32_t        events;         /* what epoll is watching for */
+    uint32_t        headersize;
+    size_t          have;           /* bytes of the current field received */
+    uint64_t        start;          /* when the request's header arrived */
+    int             parsed;         /* whether req holds a valid request */
+    size_t          bytes;          /* body bytes the request moves */
+    char           *header;
+    struct request  req;
+    struct put_sink sink;           /* where a PUT body is going */
+    struct response resp;
+    struct reader   rd;             /* bytes read ahead of the parser */
+    struct arena    arena;          /* the header, and what is built from it */
+    struct aio_op   op;             /* a GET's open or read, or work for
+                                       the aio's threads */
+    struct prefetch pf;             /* the file a GET is reading */
+    unsigned long   gen;            /* the cache's, from before it opened */
+    int           (*then)(struct conn *c);  /* what follows that work */
+    const char     *err;            /* or what it found wrong */
+    int             pending;        /* disk operations not yet finished */
+    int             orphaned;       /* closed, but waiting on the disk */
+    int             syncing;        /* how far a PUT, COMMIT or LINK is
+                                       through durability */
+    unsigned long   group;          /* the group commit it waits for */
+    struct conn    *waiter;         /* the next to wait for one */
+};
+
+/*
+ * A PUT chunk on its way to disk
+ */
+struct spill {
+    struct aio_op op;
+    char         *chunk;            /* the whole buffer, however much of it
+                                       op has left to write */
+};
+
+/*
+ * Each loop keeps its connections in order of last activity, so that idle
+ * ones can be found at the head of the list without a scan.
+ */
+struct loop {
+    int          epfd;
+    int          listenfd;
+    struct conn *head;
+    struct conn *tail;
+    struct aio  *aio;               /* NULL to use the disk directly */
+    int          flushfd;           /* ticks when a group commit is done */
+    struct conn *waiters;           /* connections waiting for one */
+    long         paused;            /* when to accept again, in ms, after
+                                       running out of descriptors; 0 if
+                                       accepting */
+};
+
+/* Seconds a connection may sit idle between requests; 0 for no keep-alive */
+static int keepalive;
+
+/* How the loops reach the disk */
+static enum aio_engine engine;
+
+/* Milliseconds a loop out of descriptors waits before accepting again */
+#define ACCEPT_RETRY_MS 100
+
+/*
+ * now() - a cheap clock for idle timeouts
+ */
+static time_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * now_ms() - the same clock, in milliseconds
+ */
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * listen_pause() - stop watching the listening socket, which would stay
+ *                  readable while there is no descriptor to accept with
+ */
+static void listen_pause(struct loop *l) {
+    struct epoll_event ev = { .events = 0, .data.ptr = NULL };
+    if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, l->listenfd, &ev) == 0)
+        l->paused = now_ms() + ACCEPT_RETRY_MS;
+}
+
+/*
+ * listen_resume() - watch the listening socket again, if it was paused
+ */
+static void listen_resume(struct loop *l) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (l->paused && epoll_ctl(l->epfd, EPOLL_CTL_MOD, l->listenfd, &ev) == 0)
+        l->paused = 0;
+}
+
+static void loop_unlink(struct loop *l, struct conn *c) {
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        l->head = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        l->tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+/*
+ * loop_touch() - mark a connection as active just now
+ */
+static void loop_touch(struct loop *l, struct conn *c, time_t t) {
+    if (l->tail != c) {
+        if (c->prev || c->next || l->head == c)
+            loop_unlink(l, c);
+        c->prev = l->tail;
+        if (l->tail)
+            l->tail->next = c;
+        else
+            l->head = c;
+        l->tail = c;
+    }
+    c->last = t;
+}
+
+static struct conn *conn_new(struct loop *l, int fd,
+                             const struct sockaddr_in *peer) {
+    struct conn *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->loop = l;
+    c->fd = fd;
+    c->peer = *peer;
+    c->state = ST_HDRLEN;
+    c->sink.fd = -1;
+    response_init(&c->resp);
+    stats_connection(1);
+    return c;
+}
+
+/*
+ * conn_release() - free a connection that nothing refers to any more
+ */
+static void conn_release(struct conn *c) {
+    close(c->fd);
+    listen_resume(c->loop);
+    put_abort(&c->sink);
+    response_free(&c->resp);
+    arena_reset(&c->arena);
+    reader_free(&c->rd);
+    free(c);
+    stats_connection(-1);
+}
+
+/*
+ * conn_free() - hang up on a connection.  Whatever the disk is still doing
+ *               for it may be using its memory, or its socket, so those
+ *               are freed when the last of it is done, and until then the
+ *               socket is only taken out of epoll.
+ */
+static void conn_free(struct loop *l, struct conn *c) {
+    loop_unlink(l, c);
+    if (c->pending) {
+        epoll_ctl(l->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        c->orphaned = 1;
+    }
+    else
+        conn_release(c);
+}
+
+/*
+ * conn_respond() - queue c->resp for sending
+ */
+static int conn_respond(struct conn *c) {
+    c->bytes = c->resp.length;
+    c->state = ST_SEND;
+    return 0;
+}
+
+/*
+ * conn_next() - after a response, get ready for the client's next request,
+ *               or return -1 if the connection should close
+ */
+static int conn_next(struct conn *c) {
+    if (!keepalive || c->closing)
+        return -1;
+    response_free(&c->resp);
+    arena_reset(&c->arena);
+    c->header = NULL;
+    c->have = 0;
+    c->parsed = 0;
+    c->state = ST_HDRLEN;
+    return 0;
+}
+
+/*
+ * conn_fail() - queue an error message for sending.  After an error we may
+ *               not know where the next request starts, so hang up after.
+ */
+static int conn_fail(struct conn *c, const char *msg) {
+    fprintf(stderr, "Sending error message to client: %s", msg);
+    stats_error(request_error(msg));
+    c->closing = 1;
+    response_error(&c->resp, msg);
+    return conn_respond(c);
+}
+
+static int conn_step(struct conn *c);
+static int conn_watch(int epfd, struct conn *c);
+static void conn_worked(struct aio_op *op, long res);
+
+/*
+ * conn_offload() - have the aio's threads do call(), which may wait on the
+ *                  disk, and then carry on with then(), unless it set
+ *                  c->err.  Returns 0, or -1 if the work can't be handed
+ *                  over.
+ */
+static int conn_offload(struct conn *c, long (*call)(struct aio_op *op),
+                        int (*then)(struct conn *c)) {
+    c->op = (struct aio_op){
+        .type = AIO_CALL, .call = call, .done = conn_worked, .arg = c
+    };
+    c->then = then;
+    c->err = NULL;
+    if (aio_submit(c->loop->aio, &c->op) < 0)
+        return -1;
+    c->pending++;
+    c->state = ST_DISK;
+    return 0;
+}
+
+/*
+ * off_send() - send the parts of a response that may wait on the disk,
+ *              until the socket is full or what is left is in memory.
+ *              Returns 0, or -errno.
+ */
+static long off_send(struct aio_op *op) {
+    struct conn *c = op->arg;
+    while (!response_sent(&c->resp) && response_blocks(&c->resp))
+        if (response_send(c->fd, &c->resp) < 0 && errno != EINTR)
+            return -errno;
+    return 0;
+}
+
+/*
+ * off_prepare() - build the response to anything but a PUT, and start
+ *                 sending it, unless it must wait for names to be durable
+ */
+static long off_prepare(struct aio_op *op) {
+    struct conn *c = op->arg;
+    if ((c->err = prepare_response(&c->req, &c->resp, &c->arena)) != NULL ||
+        c->resp.ndirs)
+        return 0;
+    c->bytes = c->resp.length;
+    return off_send(op);
+}
+
+static int conn_names(struct conn *c);
+
+/*
+ * conn_sending() - carry on sending a response that was started off the
+ *                  loop, or that was built there and is yet to start
+ */
+static int conn_sending(struct conn *c) {
+    if (c->resp.ndirs) {
+        c->syncing = 0;
+        return conn_names(c);
+    }
+    c->state = ST_SEND;
+    return 0;
+}
+
+/*
+ * conn_prepare() - build the response to anything but a PUT, off the loop
+ *                  if that may wait on the disk
+ */
+static int conn_prepare(struct conn *c) {
+    const char *err;
+    if (c->loop->aio && request_blocks(&c->req) &&
+        conn_offload(c, off_prepare, conn_sending) == 0)
+        return 0;
+    if ((err = prepare_response(&c->req, &c->resp, &c->arena)) != NULL)
+        return conn_fail(c, err);
+    c->syncing = 0;
+    return conn_names(c);
+}
+
+/*
+ * conn_wake() - carry on with a connection that a disk operation has
+ *               finished for, once nothing else holds it up.  rc says
+ *               whether what the completion did failed.
+ */
+static void conn_wake(struct conn *c, int rc) {
+    struct loop *l = c->loop;
+    if (c->orphaned) {
+        if (c->pending == 0)
+            conn_release(c);
+        return;
+    }
+    if (rc == 0 && c->state == ST_DISK)
+        return;
+    loop_touch(l, c, now());
+    if (rc < 0 || conn_step(c) < 0 || conn_watch(l->epfd, c) < 0)
+        conn_free(l, c);
+}
+
+/*
+ * conn_worked() - work handed to the aio's threads is done.  Only sending
+ *                 gives -EAGAIN, when the socket has filled up and there
+ *                 is nothing to do but wait for room.
+ */
+static void conn_worked(struct aio_op *op, long res) {
+    struct conn *c = op->arg;
+    struct loop *l = c->loop;
+    c->pending--;
+    if (c->orphaned)
+        conn_wake(c, 0);
+    else if (c->err)
+        conn_wake(c, conn_fail(c, c->err));
+    else if (res == -EAGAIN || res == -EWOULDBLOCK) {
+        c->state = ST_SEND;
+        loop_touch(l, c, now());
+        if (conn_watch(l->epfd, c) < 0)
+            conn_free(l, c);
+    }
+    else
+        conn_wake(c, res < 0 ? -1 : c->then(c));
+}
+
+static void conn_read(struct aio_op *op, long res);
+
+/*
+ * conn_read_more() - read the next part of a GET's file, or once it is all
+ *                    in, cache it and answer from the cache
+ */
+static int conn_read_more(struct conn *c) {
+    struct prefetch *pf = &c->pf;
+    if (pf->have < pf->size) {
+        c->op = (struct aio_op){
+            .type = AIO_READ, .fd = pf->fd, .buf = pf->data + pf->have,
+            .len = pf->size - pf->have, .offset = pf->have,
+            .done = conn_read, .arg = c
+        };
+        if (aio_submit(c->loop->aio, &c->op) == 0) {
+            c->pending++;
+            return 0;
+        }
+    }
+    prefetch_end(pf, &c->req);
+    return conn_prepare(c);
+}
+
+/*
+ * conn_read() - a read of a GET's file is done
+ */
+static void conn_read(struct aio_op *op, long res) {
+    struct conn *c = op->arg;
+    int rc = 0;
+    c->pending--;
+    if (res > 0)
+        c->pf.have += res;
+    /* a file that came up short, or failed, is read again the usual way */
+    if (res <= 0 || c->orphaned) {
+        prefetch_end(&c->pf, &c->req);
+        if (!c->orphaned)
+            rc = conn_prepare(c);
+    }
+    else
+        rc = conn_read_more(c);
+    conn_wake(c, rc);
+}
+
+/*
+ * conn_opened() - a GET's file is open, or couldn't be
+ */
+static void conn_opened(struct aio_op *op, long res) {
+    struct conn *c = op->arg;
+    int rc = 0;
+    c->pending--;
+    if (c->orphaned) {
+        if (res >= 0)
+            close(res);
+    }
+    else if (res >= 0 && prefetch_begin(&c->pf, res, c->gen) == 0)
+        rc = conn_read_more(c);
+    else
+        rc = conn_prepare(c);
+    conn_wake(c, rc);
+}
+
+/*
+ * conn_fetch() - answer a GET of a file the cache lacks by reading it in
+ *                without blocking, and then from the cache
+ */
+static int conn_fetch(struct conn *c) {
+    c->gen = request_generation(c->req.filename);
+    c->op = (struct aio_op){
+        .type = AIO_OPEN, .path = c->req.filename, .flags = O_RDONLY,
+        .done = conn_opened, .arg = c
+    };
+    if (aio_submit(c->loop->aio, &c->op) < 0)
+        return conn_prepare(c);
+    c->pending++;
+    c->state = ST_DISK;
+    return 0;
+}
+
+static int conn_body_next(struct conn *c);
+
+/*
+ * conn_spilled() - a write of a PUT chunk is done
+ */
+static void conn_spilled(struct aio_op *op, long res) {
+    struct spill *sp = (struct spill *)op;
+    struct conn *c = op->arg;
+    if (res > 0 && (size_t)res < op->len && !c->orphaned) {
+        op->buf += res;
+        op->len -= res;
+        op->offset += res;
+        if (aio_submit(c->loop->aio, op) == 0)
+            return;
+        res = -1;
+    }
+    put_spilled(&c->sink, sp->chunk, res >= 0 && (size_t)res == op->len);
+    free(sp);
+    c->pending--;
+    if (c->orphaned) {
+        conn_wake(c, 0);
+        return;
+    }
+    /* only a connection that stopped for the disk needs starting again */
+    if (c->state == ST_DISK) {
+        c->state = ST_BODY;
+        conn_wake(c, conn_body_next(c));
+    }
+}
+
+/*
+ * conn_spill() - the put_sink's spill(): write a chunk without waiting
+ */
+static int conn_spill(void *owner, char *buf, size_t len, off_t offset) {
+    struct conn *c = owner;
+    struct spill *sp = malloc(sizeof(*sp));
+    if (sp == NULL)
+        return -1;
+    sp->op = (struct aio_op){
+        .type = AIO_WRITE, .fd = c->sink.fd, .buf = buf, .len = len,
+        .offset = offset, .done = conn_spilled, .arg = c
+    };
+    sp->chunk = buf;
+    if (aio_submit(c->loop->aio, &sp->op) < 0) {
+        free(sp);
+        return -1;
+    }
+    c->pending++;
+    return 0;
+}
+
+/*
+ * conn_put_ok() - acknowledge a PUT that is in place
+ */
+static int conn_put_ok(struct conn *c) {
+    if (response_ok(&c->resp, c->req.want_digest && c->sink.digest[0]
+                                  ? c->sink.digest : NULL, &c->arena) < 0 ||
+        conn_respond(c) < 0)
+        return -1;
+    c->bytes = c->req.filesize;
+    return 0;
+}
+
+static void conn_synced(struct aio_op *op, long res);
+
+/*
+ * conn_sync() - start making n of a request's files durable, or with dirs,
+ *               its directories: for group commit by joining the next
+ *               group, and otherwise through the aio, one at a time.
+ *               Returns how many it started on, or -1 on failure.
+ */
+static int conn_sync(struct conn *c, const int *fds, int n, int dirs) {
+    if (durable_mode() == DURABLE_GROUP) {
+        if (durable_join(fds, n, &c->group) < 0)
+            return -1;
+        c->waiter = c->loop->waiters;
+        c->loop->waiters = c;
+    }
+    else {
+        c->op = (struct aio_op){
+            .type = AIO_FSYNC, .fd = fds[0], .flags = dirs ? 0 : AIO_DATASYNC,
+            .done = conn_synced, .arg = c
+        };
+        if (aio_submit(c->loop->aio, &c->op) < 0)
+            return -1;
+        n = 1;
+    }
+    c->pending++;
+    c->state = ST_DISK;
+    return n;
+}
+
+/*
+ * conn_unwritable() - give up on a PUT, COMMIT or LINK that couldn't be
+ *                     made durable
+ */
+static int conn_unwritable(struct conn *c) {
+    if (c->req.type == REQ_PUT) {
+        put_abort(&c->sink);
+        return conn_fail(c, PUT_UNWRITABLE);
+    }
+    response_free(&c->resp);
+    return conn_fail(c, c->req.type == REQ_COMMIT ? COMMIT_UNWRITABLE
+                                                  : LINK_UNWRITABLE);
+}
+
+/*
+ * conn_names() - send the response to a COMMIT or LINK once the directory
+ *                entries it changed are durable, c->syncing counting the
+ *                directories started on; any other response goes at once
+ */
+static int conn_names(struct conn *c) {
+    struct response *r = &c->resp;
+    int n;
+    if (c->syncing < r->ndirs) {
+        if ((n = conn_sync(c, r->dirs + c->syncing, r->ndirs - c->syncing,
+                           1)) < 0)
+            return conn_unwritable(c);
+        c->syncing += n;
+        return 0;
+    }
+    while (r->ndirs > 0)
+        close(r->dirs[--r->ndirs]);
+    return conn_respond(c);
+}
+
+/*
+ * off_put_install() - move a PUT's file into place
+ */
+static long off_put_install(struct aio_op *op) {
+    struct conn *c = op->arg;
+    c->err = put_install(&c->req, &c->sink);
+    return 0;
+}
+
+static int conn_durable(struct conn *c);
+
+/*
+ * conn_installed() - carry on making a PUT durable once it is in place
+ */
+static int conn_installed(struct conn *c) {
+    c->syncing = 2;
+    return conn_durable(c);
+}
+
+/*
+ * conn_durable() - take a PUT whose body is all written out through being
+ *                  made durable: its data, then its move into place, then
+ *                  the directories that changed, then its acknowledgement.
+ *                  c->syncing counts the steps taken.
+ */
+static int conn_durable(struct conn *c) {
+    struct put_sink *sink = &c->sink;
+    const char *err;
+    int n;
+    if (c->syncing == 0) {
+        if (conn_sync(c, &sink->fd, 1, 0) < 0)
+            goto fail;
+        c->syncing = 1;
+        return 0;
+    }
+    if (c->syncing == 1) {
+        if (conn_offload(c, off_put_install, conn_installed) == 0)
+            return 0;
+        if ((err = put_install(&c->req, sink)) != NULL)
+            return conn_fail(c, err);
+        c->syncing = 2;
+    }
+    if (c->syncing - 2 < sink->ndirs) {
+        int done = c->syncing - 2;
+        if ((n = conn_sync(c, sink->dirs + done, sink->ndirs - done, 1)) < 0)
+            goto fail;
+        c->syncing += n;
+        return 0;
+    }
+    put_close(sink);
+    return conn_put_ok(c);
+
+  fail:
+    return conn_unwritable(c);
+}
+
+/*
+ * conn_durable_next() - carry on with a PUT, COMMIT or LINK once a step of
+ *                       making it durable is over, or ok says it failed
+ */
+static void conn_durable_next(struct conn *c, int ok) {
+    int rc = 0;
+    c->pending--;
+    if (!c->orphaned) {
+        if (!ok)
+            rc = conn_unwritable(c);
+        else if (c->req.type == REQ_PUT)
+            rc = conn_durable(c);
+        else
+            rc = conn_names(c);
+    }
+    conn_wake(c, rc);
+}
+
+/*
+ * conn_synced() - an fsync of a PUT's file, or of a directory, is done
+ */
+static void conn_synced(struct aio_op *op, long res) {
+    conn_durable_next(op->arg, res == 0);
+}
+
+/*
+ * loop_flushed() - carry on with the connections whose group commit is
+ *                  done
+ */
+static void loop_flushed(struct loop *l) {
+    uint64_t ticks;
+    if (read(l->flushfd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+        return;
+    struct conn **p = &l->waiters;
+    while (*p) {
+        struct conn *c = *p;
+        int rc = durable_done(c->group);
+        if (rc == 0) {
+            p = &c->waiter;
+            continue;
+        }
+        /* this may set c waiting again, at the head of the list */
+        *p = c->waiter;
+        conn_durable_next(c, rc > 0);
+    }
+}
+
+/*
+ * off_put_commit() - move a PUT's file into place, with nothing to wait
+ *                    for after
+ */
+static long off_put_commit(struct aio_op *op) {
+    struct conn *c = op->arg;
+    c->err = put_commit(&c->req, &c->sink);
+    return 0;
+}
+
+/*
+ * conn_put_done() - acknowledge a PUT whose body has all arrived, once it
+ *                   is as durable as it is to be
+ */
+static int conn_put_done(struct conn *c) {
+    const char *err;
+    if (durable_mode() == DURABLE_NONE || c->loop->aio == NULL) {
+        if (c->loop->aio && conn_offload(c, off_put_commit, conn_put_ok) == 0)
+            return 0;
+        if ((err = put_commit(&c->req, &c->sink)) != NULL)
+            return conn_fail(c, err);
+        return conn_put_ok(c);
+    }
+    if ((err = put_finish(&c->sink)) != NULL)
+        return conn_fail(c, err);
+    c->syncing = 0;
+    return conn_durable(c);
+}
+
+/*
+ * conn_body_next() - after some of a PUT's body, wait for the disk if too
+ *                    much of it is still being written, and once all of it
+ *                    is in, or it has failed, finish the PUT when the disk
+ *                    has caught up
+ */
+static int conn_body_next(struct conn *c) {
+    if (c->sink.remaining > 0 && !c->sink.failed) {
+        if (c->pending >= EV_SPILLS)
+            c->state = ST_DISK;
+        return 0;
+    }
+    if (!c->sink.failed && put_drain(&c->sink) < 0)
+        c->sink.failed = 1;
+    if (c->pending) {
+        c->state = ST_DISK;
+        return 0;
+    }
+    return conn_put_done(c);
+}
+
+/*
+ * conn_put_body() - start taking in a PUT's body, once its file is made
+ */
+static int conn_put_body(struct conn *c) {
+    if (c->loop->aio) {
+        c->sink.spill = conn_spill;
+        c->sink.owner = c;
+    }
+    c->state = ST_BODY;
+    return conn_body_next(c);
+}
+
+/*
+ * off_put_begin() - make the file a PUT's body goes to
+ */
+static long off_put_begin(struct aio_op *op) {
+    struct conn *c = op->arg;
+    c->err = put_begin(&c->req, &c->sink);
+    return 0;
+}
+
+/*
+ * conn_dispatch() - act on a fully received header
+ */
+static int conn_dispatch(struct conn *c) {
+    const char *err;
+    c->header[c->headersize] = '\0';
+    c->start = stats_now();
+    if ((err = parse_request(c->header, &c->req)) != NULL)
+        return conn_fail(c, err);
+    c->parsed = 1;
+
+    /* names are made durable here, without waiting, when they can be */
+    c->req.defer_sync = c->loop->aio != NULL;
+    if (c->req.type != REQ_PUT) {
+        if (c->loop->aio && request_prefetch(&c->req))
+            return conn_fetch(c);
+        return conn_prepare(c);
+    }
+
+    /* PUT: stream the body to disk */
+    if (c->loop->aio && conn_offload(c, off_put_begin, conn_put_body) == 0)
+        return 0;
+    if ((err = put_begin(&c->req, &c->sink)) != NULL)
+        return conn_fail(c, err);
+    return conn_put_body(c);
+}
+
+/*
+ * conn_io_done() - classify a failed or empty recv()/send(): returns 1 if
+ *                  the connection should wait for epoll, 0 to retry, or -1
+ *                  if it is finished
+ */
+static int conn_io_done(ssize_t n) {
+    if (n == 0)
+        return -1;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+    if (errno == EINTR)
+        return 0;
+    return -1;
+}
+
+/*
+ * conn_step() - make as much progress on a connection as the socket allows.
+ *               Returns 0 to keep waiting, or -1 to close the connection.
+ */
+static int conn_step(struct conn *c) {
+    while (1) {
+        ssize_t n;
+        int rc;
+        switch (c->state) {
+          case ST_HDRLEN:
+            n = reader_recv(&c->rd, c->fd, (char *)&c->headersize + c->have,
+                            sizeof(uint32_t) - c->have);
+            if (n <= 0) {
+                if ((rc = conn_io_done(n)) != 0)
+                    return rc > 0 ? 0 : -1;
+                break;
+            }
+            if ((c->have += n) < sizeof(uint32_t))
+                break;
+            c->have = 0;
+            if (c->headersize == 0 || c->headersize > REQ_MAX_HEADER) {
+                c->start = stats_now();
+                if (conn_fail(c, HEADER_TOO_LARGE) < 0)
+                    return -1;
+                break;
+            }
+            c->header = arena_alloc(&c->arena, c->headersize + 1);
+            if (c->header == NULL)
+                return -1;
+            c->state = ST_HEADER;
+            break;
+
+          case ST_HEADER:
+            n = reader_recv(&c->rd, c->fd, c->header + c->have,
+                            c->headersize - c->have);
+            if (n <= 0) {
+                if ((rc = conn_io_done(n)) != 0)
+                    return rc > 0 ? 0 : -1;
+                break;
+            }
+            if ((c->have += n) < c->headersize)
+                break;
+            if (conn_dispatch(c) < 0)
+                return -1;
+            break;
+
+          case ST_BODY: {
+            size_t len;
+            char *p = put_space(&c->sink, &len);
+            n = reader_recv(&c->rd, c->fd, p, len);
+            if (n <= 0) {
+                if ((rc = conn_io_done(n)) != 0)
+                    return rc > 0 ? 0 : -1;
+                break;
+            }
+            if (put_received(&c->sink, n) < 0)
+                c->sink.failed = 1;
+            if (conn_body_next(c) < 0)
+                return -1;
+            break;
+          }
+
+          case ST_DISK:
+            return 0;
+
+          case ST_SEND:
+            if (response_sent(&c->resp)) {
+                /* only a failed request closes the connection behind it */
+                uint64_t ns = stats_now() - c->start;
+                if (!c->closing)
+                    stats_request(c->req.type, ns);
+                accesslog_request(&c->peer, c->parsed ? &c->req : NULL,
+                                  !c->closing, c->bytes, ns);
+                if (conn_next(c) < 0)
+                    return -1;
+                break;
+            }
+            if (c->loop->aio && response_blocks(&c->resp) &&
+                conn_offload(c, off_send, conn_sending) == 0)
+                return 0;
+            n = response_send(c->fd, &c->resp);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                if (errno == EINTR)
+                    break;
+                return -1;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * conn_watch() - point epoll at whichever direction the connection is
+ *                waiting on
+ */
+static int conn_watch(int epfd, struct conn *c) {
+    uint32_t want = c->state == ST_SEND ? EPOLLOUT
+                  : c->state == ST_DISK ? 0 : EPOLLIN;
+    if (want == c->events)
+        return 0;
+    struct epoll_event ev = { .events = want, .data.ptr = c };
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        return -1;
+    c->events = want;
+    return 0;
+}
+
+/*
+ * accept_all() - accept every pending connection on a listening socket
+ */
+static void accept_all(struct loop *l) {
+    time_t t = now();
+    while (1) {
+        struct sockaddr_in clientaddr;
+        socklen_t clientlen = sizeof(clientaddr);
+        int connfd = accept4(l->listenfd, (struct sockaddr *)&clientaddr,
+                             &clientlen, SOCK_NONBLOCK);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "Error in accept(): %s\n", strerror(errno));
+            /* the connection stays queued until a descriptor is freed */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+                errno == ENOMEM)
+                listen_pause(l);
+            return;
+        }
+
+        struct conn *c = conn_new(l, connfd, &clientaddr);
+        if (c == NULL) {
+            close(connfd);
+            continue;
+        }
+        loop_touch(l, c, t);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            fprintf(stderr, "Error in epoll_ctl(): %s\n", strerror(errno));
+            conn_free(l, c);
+            continue;
+        }
+        c->events = EPOLLIN;
+    }
+}
+
+/*
+ * expire() - hang up on connections that have been idle too long, and
+ *            return how many milliseconds until the next one would be
+ */
+static int expire(struct loop *l, time_t t) {
+    if (!keepalive)
+        return -1;
+    while (l->head && t - l->head->last >= keepalive)
+        conn_free(l, l->head);
+    if (l->head == NULL)
+        return -1;
+    return (l->head->last + keepalive - t) * 1000;
+}
+
+/*
+ * event_loop() - serve one listening socket forever
+ */
+static void *event_loop(void *arg) {
+    struct loop l = { .listenfd = (int)(intptr_t)arg };
+    if ((l.epfd = epoll_create1(0)) < 0) {
+        fprintf(stderr, "Error in epoll_create1(): %s\n", strerror(errno));
+        exit(0);
+    }
+    /* the listening socket is the only entry without a connection, and
+       the loop itself stands for its disk completions */
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(l.epfd, EPOLL_CTL_ADD, l.listenfd, &ev) < 0) {
+        fprintf(stderr, "Error in epoll_ctl(): %s\n", strerror(errno));
+        exit(0);
+    }
+    if (engine != AIO_NONE) {
+        struct epoll_event aev = { .events = EPOLLIN, .data.ptr = &l };
+        if ((l.aio = aio_create(engine)) == NULL ||
+            epoll_ctl(l.epfd, EPOLL_CTL_ADD, aio_fd(l.aio), &aev) < 0) {
+            fprintf(stderr, "Error starting disk I/O: %s\n", strerror(errno));
+            exit(0);
+        }
+    }
+    /* and its list of waiters for the group commits they joined */
+    if (l.aio && durable_mode() == DURABLE_GROUP) {
+        struct epoll_event fev = { .events = EPOLLIN, .data.ptr = &l.waiters };
+        if ((l.flushfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+            durable_watch(l.flushfd) < 0 ||
+            epoll_ctl(l.epfd, EPOLL_CTL_ADD, l.flushfd, &fev) < 0) {
+            fprintf(stderr, "Error starting group commit: %s\n",
+                    strerror(errno));
+            exit(0);
+        }
+    }
+
+    struct epoll_event events[EV_MAXEVENTS];
+    int timeout = -1;
+    while (1) {
+        if (l.aio)
+            aio_flush(l.aio);
+        int n = epoll_wait(l.epfd, events, EV_MAXEVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error in epoll_wait(): %s\n", strerror(errno));
+            exit(0);
+        }
+        time_t t = now();
+        if (l.paused && now_ms() >= l.paused)
+            listen_resume(&l);
+        int reap = 0, flushed = 0;
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_all(&l);
+                continue;
+            }
+            if (c == (void *)&l) {
+                reap = 1;
+                continue;
+            }
+            if (c == (void *)&l.waiters) {
+                flushed = 1;
+                continue;
+            }
+            /* nothing is asked of a connection waiting on the disk, so
+               this is a hangup or an error */
+            if (c->state == ST_DISK) {
+                conn_free(&l, c);
+                continue;
+            }
+            loop_touch(&l, c, t);
+            if (conn_step(c) < 0 || conn_watch(l.epfd, c) < 0)
+                conn_free(&l, c);
+        }
+        /* completions may free any connection, so they wait until none
+           of this round's events are left to refer to one */
+        if (reap)
+            aio_reap(l.aio);
+        if (flushed)
+            loop_flushed(&l);
+        timeout = expire(&l, t);
+        if (l.paused) {
+            long wait = l.paused - now_ms();
+            if (wait < 0)
+                wait = 0;
+            if (timeout < 0 || timeout > wait)
+                timeout = wait;
+        }
+    }
+    return NULL;
+}
+
+void event_serve(int *listenfds, int nloops, int idle_timeout,
+                 enum aio_engine disk) {
+    keepalive = idle_timeout;
+    engine = disk;
+    for (int i = 0; i < nloops; i++) {
+        int flags = fcntl(listenfds[i], F_GETFL, 0);
+        fcntl(listenfds[i], F_SETFL, flags | O_NONBLOCK);
+    }
+    for (int i = 1; i < nloops; i++) {
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, event_loop,
+                                (void *)(intptr_t)listenfds[i]);
+        if (rc != 0) {
+            fprintf(stderr, "Error in pthread_create(): %s\n", strerror(rc));
+            exit(0);
+        }
+        pthread_detach(tid);
+    }
+    event_loop((void *)(intptr_t)listenfds[0]);
+}
@@ -0,0 +1,31 @@
+#ifndef EVENT_H__
+#define EVENT_H__
+
+#include "aio.h"
+
+/*
+ * An event-driven alternative to handle_requests().  Each loop owns one
+ * listening socket and an epoll set, and drives every connection it accepts
+ * through a small state machine with non-blocking reads and writes, so that
+ * slow or idle clients cost a little memory rather than a thread.  With an
+ * aio engine other than AIO_NONE, the disk doesn't hold the loops up
+ * either: a GET of a file the cache lacks reads it in through the aio (see
+ * aio.h) before answering from the cache, and a PUT's body is written
+ * through it, a few chunks at a time.  What else may wait on the disk, such
+ * as a GET of a file too big to cache, an MGET or a SUM, or making and
+ * renaming a PUT's file, runs on the aio's threads.
+ */
+
+/*
+ * event_serve() - run one event loop per listening socket, all but the first
+ *                 on a new thread.  The sockets should share a port through
+ *                 SO_REUSEPORT so the kernel spreads clients across them.
+ *                 With a nonzero keepalive, connections carry any number of
+ *                 requests until they sit idle for that many seconds.
+ *                 Each loop reaches the disk through an aio of the given
+ *                 engine.  Does not return.
+ */
+void event_serve(int *listenfds, int nloops, int keepalive,
+                 enum aio_engine disk);
+
+#endif
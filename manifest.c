@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cache.h"
+#include "manifest.h"
+#include "request.h"
+
+static struct {
+    char     *path;
+    sigset_t  stop;             /* the signals that end the server */
+    int       warming;          /* read and written atomically */
+} manifest;
+
+/*
+ * add_line() - write one cached file into a manifest
+ */
+static void add_line(const struct cache_entry *e, void *arg) {
+    /* compressed forms have a newline in their keys; they are remade on
+       demand anyway */
+    if (strchr(e->key, '\n') == NULL)
+        fprintf(arg, "%s %s\n", e->digest[0] ? e->digest : "-", e->key);
+}
+
+/*
+ * save() - write out what the cache holds now.  Returns 0, or -1 on
+ *          failure.
+ */
+static int save(void) {
+    /* gather the lines in memory first, so that the cache isn't held up
+       by the disk */
+    char *text = NULL, *tmp = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&text, &len);
+    if (mem == NULL)
+        return -1;
+    request_cached(add_line, mem);
+    if (fclose(mem) != 0) {
+        free(text);
+        return -1;
+    }
+
+    int rc = -1;
+    FILE *fp = NULL;
+    if (asprintf(&tmp, "%s.tmp", manifest.path) >= 0 &&
+        (fp = fopen(tmp, "w")) != NULL && fwrite(text, 1, len, fp) == len &&
+        fflush(fp) == 0 && fdatasync(fileno(fp)) == 0) {
+        rc = fclose(fp);
+        fp = NULL;
+        if (rc == 0)
+            rc = rename(tmp, manifest.path);
+    }
+    if (fp)
+        fclose(fp);
+    if (rc < 0 && tmp)
+        unlink(tmp);
+    free(tmp);
+    free(text);
+    return rc;
+}
+
+/*
+ * saver() - save the manifest every MANIFEST_PERIOD seconds, and a last
+ *           time when the server is told to stop
+ */
+static void *saver(void *arg) {
+    while (1) {
+        struct timespec period = { MANIFEST_PERIOD, 0 };
+        int signo = sigtimedwait(&manifest.stop, NULL, &period);
+        if (signo < 0 && errno == EINTR)
+            continue;
+        if (!__atomic_load_n(&manifest.warming, __ATOMIC_ACQUIRE) &&
+            save() < 0)
+            fprintf(stderr, "Error saving cache manifest, %s\n",
+                    strerror(errno));
+        if (signo > 0)
+            exit(0);
+    }
+    return NULL;
+}
+
+/*
+ * A file of the warm-up batch being read ahead
+ */
+struct warm_file {
+    int           fd;
+    char         *key;
+    char         *digest;       /* NULL if the manifest didn't know it */
+    unsigned long gen;          /* the cache's, from before it was opened */
+};
+
+/*
+ * warm_batch() - load a batch of files whose reads are under way, and
+ *                close them
+ */
+static void warm_batch(struct warm_file *batch, int n) {
+    for (int i = 0; i < n; i++) {
+        request_warm(batch[i].key, batch[i].fd, batch[i].digest,
+                     batch[i].gen);
+        close(batch[i].fd);
+    }
+}
+
+/*
+ * warmer() - read the files of the manifest back into the cache
+ */
+static void *warmer(void *arg) {
+    FILE *fp = arg;
+    struct warm_file batch[WARM_BATCH];
+    char *lines[WARM_BATCH] = { NULL };
+    size_t caps[WARM_BATCH] = { 0 };
+    int n = 0;
+
+    /* each batch keeps its lines, which its keys and digests point into */
+    while (getline(&lines[n], &caps[n], fp) > 0) {
+        char *line = lines[n], *key = strchr(line, ' ');
+        if (key == NULL)
+            continue;
+        *key++ = '\0';
+        key[strcspn(key, "\n")] = '\0';
+        unsigned long gen = request_generation(key);
+        int fd = open(key, O_RDONLY);
+        if (fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        batch[n] = (struct warm_file){
+            fd, key, strcmp(line, "-") == 0 ? NULL : line, gen
+        };
+        if (++n == WARM_BATCH) {
+            warm_batch(batch, n);
+            n = 0;
+        }
+    }
+    warm_batch(batch, n);
+    for (int i = 0; i < WARM_BATCH; i++)
+        free(lines[i]);
+    fclose(fp);
+    __atomic_store_n(&manifest.warming, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int manifest_open(const char *path) {
+    if ((manifest.path = strdup(path)) == NULL)
+        return -1;
+    sigemptyset(&manifest.stop);
+    sigaddset(&manifest.stop, SIGINT);
+    sigaddset(&manifest.stop, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &manifest.stop, NULL) != 0)
+        return -1;
+
+    /* no manifest yet is a cold start, not an error */
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL && errno != ENOENT)
+        return -1;
+    manifest.warming = fp != NULL;
+
+    /* our threads take no signals but those saver() waits for */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, saver, NULL);
+    if (rc == 0)
+        pthread_detach(tid);
+    if (rc == 0 && fp && (rc = pthread_create(&tid, NULL, warmer, fp)) == 0)
+        pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        if (fp)
+            fclose(fp);
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef MANIFEST_H__
+#define MANIFEST_H__
+
+/*
+ * A record of what the file cache holds, kept on disk so that a restarted
+ * server doesn't begin cold.  The manifest is a line per cached file, its
+ * MD5 (or "-" if unknown) and then its key, in the order cache_walk() gives
+ * them.  It is rewritten every MANIFEST_PERIOD seconds, and once more when
+ * SIGINT or SIGTERM stops the server, each time to a file beside it that is
+ * then renamed over it, so that a crash leaves the last one whole.
+ *
+ * At startup, a thread reads the files of the last manifest back into the
+ * cache while the server takes connections.  It works through them
+ * WARM_BATCH at a time, opening a whole batch and asking the kernel to read
+ * each file ahead before loading any of them, so that the disk sees many
+ * requests at once rather than one file's worth at a time.  A file whose
+ * stored MD5 shows it has changed since the manifest was written is left
+ * for GETs to bring in.  Until warming is done the manifest is not
+ * rewritten, since the cache then holds less than it describes.
+ */
+
+/* Seconds between saves of the manifest */
+#define MANIFEST_PERIOD 60
+
+/* Files whose reads the warm-up starts together */
+#define WARM_BATCH 64
+
+/*
+ * manifest_open() - warm the cache from the manifest at path, if there is
+ *                   one, and keep the manifest up to date from now on.
+ *                   This must precede the creation of other threads, as
+ *                   they must leave SIGINT and SIGTERM to it.  Returns 0,
+ *                   or -1 on failure.
+ */
+int manifest_open(const char *path);
+
+#endif
@@ -0,0 +1,97 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pool.h"
+#include "stats.h"
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;      /* signalled when a connection is queued */
+    pthread_cond_t  not_full;       /* signalled when a worker takes one */
+    int            *queue;          /* ring of connected sockets */
+    int             capacity;
+    int             head;           /* index of the oldest queued socket */
+    int             count;
+    void          (*service_function)(int, int);
+    int             param;
+};
+
+/*
+ * pool_take() - remove the oldest connection from the queue, waiting for
+ *               one to arrive if the queue is empty
+ */
+static int pool_take(struct pool *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->count == 0)
+        pthread_cond_wait(&p->not_empty, &p->lock);
+    int connfd = p->queue[p->head];
+    p->head = (p->head + 1) % p->capacity;
+    p->count--;
+    stats_queued(-1);
+    pthread_cond_signal(&p->not_full);
+    pthread_mutex_unlock(&p->lock);
+    return connfd;
+}
+
+/*
+ * worker() - serve queued connections forever
+ */
+static void *worker(void *arg) {
+    struct pool *p = arg;
+    while (1) {
+        int connfd = pool_take(p);
+        p->service_function(connfd, p->param);
+        if (close(connfd) < 0)
+            fprintf(stderr, "Error in close(): %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+struct pool *pool_create(int nthreads, int queue_size,
+                         void (*service_function)(int, int), int param) {
+    struct pool *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+    p->queue = calloc(queue_size, sizeof(int));
+    if (p->queue == NULL) {
+        free(p);
+        return NULL;
+    }
+    p->capacity = queue_size;
+    p->service_function = service_function;
+    p->param = param;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->not_empty, NULL);
+    pthread_cond_init(&p->not_full, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, worker, p);
+        if (rc != 0) {
+            fprintf(stderr, "Error in pthread_create(): %s\n", strerror(rc));
+            /* workers already running keep the pool usable */
+            if (i == 0) {
+                free(p->queue);
+                free(p);
+                return NULL;
+            }
+            break;
+        }
+        pthread_detach(tid);
+    }
+    return p;
+}
+
+void pool_submit(struct pool *p, int connfd) {
+    pthread_mutex_lock(&p->lock);
+    while (p->count == p->capacity)
+        pthread_cond_wait(&p->not_full, &p->lock);
+    p->queue[(p->head + p->count) % p->capacity] = connfd;
+    p->count++;
+    stats_queued(1);
+    pthread_cond_signal(&p->not_empty);
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,26 @@
+#ifndef POOL_H__
+#define POOL_H__
+
+/*
+ * A fixed set of worker threads that service connections handed to them by
+ * the accept loop.  Connections wait in a bounded queue; when the queue is
+ * full, pool_submit() blocks, so a burst of clients backs up into the
+ * kernel's listen queue instead of growing the server without limit.
+ */
+struct pool;
+
+/*
+ * Start nthreads workers that each run service_function(connfd, param) on
+ * connections taken from a queue of at most queue_size entries.  Returns
+ * NULL on failure.
+ */
+struct pool *pool_create(int nthreads, int queue_size,
+                         void (*service_function)(int, int), int param);
+
+/*
+ * Queue a connected socket for service.  The worker that takes it is
+ * responsible for closing it.  Blocks while the queue is full.
+ */
+void pool_submit(struct pool *p, int connfd);
+
+#endif
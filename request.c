@@ -0,0 +1,1476 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "cache.h"
+#include "digest.h"
+#include "durable.h"
+#include "request.h"
+#include "stats.h"
+#include "store.h"
+
+/* The file cache shared by every connection, or NULL when disabled */
+static struct cache *cache;
+
+/* The answer to a request of a type we don't know */
+#define BAD_TYPE \
+    "Request must begin with PUT, GET, MGET, SUM, COMMIT, LINK or STATS\n"
+
+/* The other errors the handlers report, by what went wrong */
+#define NO_FILENAME       "Request must include filename\n"
+#define NO_FILESIZE       "PUT request must include filesize\n"
+#define BAD_FILESIZE      "Invalid filesize in PUT request\n"
+#define NO_MD5            "COMMIT request must include MD5\n"
+#define NO_SHA256         "LINK request must include SHA-256\n"
+#define BAD_RANGE         "Invalid Range in request\n"
+#define TOO_MANY_FILES    "Too many files in MGET request\n"
+#define NO_RANGES         "COMMIT has no ranges to commit\n"
+#define GET_NOT_FOUND     "GET file not found\n"
+#define SUM_NOT_FOUND     "SUM file not found\n"
+#define GET_UNSATISFIABLE "GET range not satisfiable\n"
+#define COMMIT_MISMATCH   "COMMIT file does not match MD5\n"
+#define GET_UNREADABLE    "GET file could not be read\n"
+#define MGET_UNREADABLE   "MGET could not be satisfied\n"
+#define SUM_UNREADABLE    "SUM file could not be read\n"
+#define STATS_UNAVAILABLE "STATS could not be gathered\n"
+
+/* What kind of error each message reports, for counting */
+static const struct {
+    const char    *msg;
+    enum req_error kind;
+} error_kinds[] = {
+    { BAD_TYPE,          ERR_BAD_REQUEST },
+    { HEADER_TOO_LARGE,  ERR_BAD_REQUEST },
+    { NO_FILENAME,       ERR_BAD_REQUEST },
+    { NO_FILESIZE,       ERR_BAD_REQUEST },
+    { BAD_FILESIZE,      ERR_BAD_REQUEST },
+    { NO_MD5,            ERR_BAD_REQUEST },
+    { NO_SHA256,         ERR_BAD_REQUEST },
+    { BAD_RANGE,         ERR_BAD_REQUEST },
+    { TOO_MANY_FILES,    ERR_BAD_REQUEST },
+    { NO_RANGES,         ERR_BAD_REQUEST },
+    { GET_NOT_FOUND,     ERR_NOT_FOUND },
+    { SUM_NOT_FOUND,     ERR_NOT_FOUND },
+    { GET_UNSATISFIABLE, ERR_RANGE },
+    { COMMIT_MISMATCH,   ERR_DIGEST },
+    { GET_UNREADABLE,    ERR_IO },
+    { MGET_UNREADABLE,   ERR_IO },
+    { SUM_UNREADABLE,    ERR_IO },
+    { COMMIT_UNWRITABLE, ERR_IO },
+    { LINK_UNWRITABLE,   ERR_IO },
+    { PUT_UNWRITABLE,    ERR_IO },
+    { STATS_UNAVAILABLE, ERR_OTHER },
+};
+
+/* Permissions for files created by PUT; umask() can't be read thread-safely */
+static mode_t put_mode;
+
+/* Whether files are cached by mapping them rather than reading them */
+static int map_files;
+
+int request_init(size_t max_entries, size_t max_bytes, int map,
+                 enum cache_policy policy) {
+    mode_t mask = umask(0);
+    umask(mask);
+    put_mode = 0666 & ~mask;
+    map_files = map;
+    /* pooled buffers hold whole frames */
+    if (frame_bound(FRAME_RAW_MAX) > BUF_SIZE)
+        return -1;
+    if (max_entries == 0)
+        return 0;
+    if ((cache = cache_create(max_entries, max_bytes, policy)) == NULL)
+        return -1;
+    return 0;
+}
+
+const char *parse_request(char *header, struct request *req) {
+    char *saveptr;
+    memset(req, 0, sizeof(*req));
+
+    /* first line says what kind of request this is */
+    char *request_type = strtok_r(header, "\n", &saveptr);
+    if (request_type == NULL)
+        return BAD_TYPE;
+    if (strcmp(request_type, "PUT") == 0)
+        req->type = REQ_PUT;
+    else if (strcmp(request_type, "GET") == 0)
+        req->type = REQ_GET;
+    else if (strcmp(request_type, "MGET") == 0)
+        req->type = REQ_MGET;
+    else if (strcmp(request_type, "SUM") == 0)
+        req->type = REQ_SUM;
+    else if (strcmp(request_type, "COMMIT") == 0)
+        req->type = REQ_COMMIT;
+    else if (strcmp(request_type, "LINK") == 0)
+        req->type = REQ_LINK;
+    else if (strcmp(request_type, "STATS") == 0)
+        req->type = REQ_STATS;
+    else
+        return BAD_TYPE;
+
+    /* STATS is about the server, so it names no file */
+    if (req->type == REQ_STATS)
+        return NULL;
+
+    /* an MGET names its files one per line; prepare_mget() splits them */
+    if (req->type == REQ_MGET) {
+        req->names = saveptr;
+        req->filename = req->names;
+        if (strspn(req->names, "\n") == strlen(req->names))
+            return NO_FILENAME;
+        return NULL;
+    }
+
+    /* next line is the filename */
+    if ((req->filename = strtok_r(NULL, "\n", &saveptr)) == NULL)
+        return NO_FILENAME;
+
+    /* PUTs also say how many bytes of file follow the header, and COMMITs
+       how large the finished file is */
+    if (req->type == REQ_PUT || req->type == REQ_COMMIT) {
+        char *filesize_str = strtok_r(NULL, "\n", &saveptr);
+        if (filesize_str == NULL)
+            return NO_FILESIZE;
+        char *t;
+        req->filesize = strtol(filesize_str, &t, 10);
+        if (filesize_str == t || req->filesize < 0)
+            return BAD_FILESIZE;
+    }
+
+    /* and COMMITs what the file should hash to */
+    if (req->type == REQ_COMMIT) {
+        req->digest = strtok_r(NULL, "\n", &saveptr);
+        if (req->digest == NULL || strlen(req->digest) != MD5_HEX_LEN)
+            return NO_MD5;
+    }
+
+    /* LINKs name the content they want by its SHA-256 */
+    if (req->type == REQ_LINK) {
+        req->digest = strtok_r(NULL, "\n", &saveptr);
+        if (req->digest == NULL)
+            return NO_SHA256;
+    }
+
+    /* any further lines are options; ignore those we don't know */
+    for (char *line = strtok_r(NULL, "\n", &saveptr); line;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        if (strncmp(line, "Range ", 6) == 0) {
+            /* a GET may leave out the length, to read to the end */
+            req->length = -1;
+            int n = sscanf(line + 6, "%ld %ld", &req->offset, &req->length);
+            if (n < 1 || (n == 1 && req->type != REQ_GET) ||
+                req->offset < 0 || req->length < -1)
+                return BAD_RANGE;
+            req->ranged = 1;
+        }
+        else if (strcmp(line, "Digest") == 0)
+            req->want_digest = 1;
+        else if (strncmp(line, "If-None-Match ", 14) == 0)
+            req->match = line + 14;
+        else if (strcmp(line, "Compress deflate") == 0)
+            req->compress = 1;
+    }
+    if (req->type == REQ_PUT && req->ranged &&
+        req->filesize > req->length - req->offset)
+        return BAD_RANGE;
+    return NULL;
+}
+
+/*
+ * hidden_name() - the name of a hidden file beside filename, which rename()
+ *                 can move over it: "dir/.base" followed by suffix
+ */
+static char *hidden_name(const char *filename, const char *suffix) {
+    char *dir = strdup(filename), *base = strdup(filename), *name = NULL;
+    if (dir && base && asprintf(&name, "%s/.%s%s", dirname(dir),
+                                basename(base), suffix) < 0)
+        name = NULL;
+    free(dir);
+    free(base);
+    return name;
+}
+
+/*
+ * file_digest() - the MD5 of a regular file, from what was stored with it
+ *                 if that is still current, or else by reading it through
+ *                 once and storing the result.  Returns 0, or -1 if the
+ *                 file can't be hashed.
+ *
+ * The MD5 goes in a response's header, ahead of the body, so it can't be
+ * worked out as the body is sent.  A file read into the cache is hashed as
+ * it is read, but the first Digest GET of an unhashed file that is sent
+ * from disk reads it twice: once here, and again, usually from the page
+ * cache, as it is sent.  Later GETs use the stored digest.
+ */
+static int file_digest(int fd, const struct stat *st, char *hex) {
+    if (!S_ISREG(st->st_mode))
+        return -1;
+    if (digest_load(fd, st, hex) == 0)
+        return 0;
+    if (hash_fd(fd, st->st_size, EVP_md5(), hex) < 0)
+        return -1;
+    digest_store(fd, hex);
+    return 0;
+}
+
+/*
+ * map_file() - map a whole file into a cache entry, or return NULL if it
+ *              can't be mapped.  Mapping reads nothing, so the entry only
+ *              gets an MD5 here if one was stored with the file; hashing
+ *              it waits for a request that wants it (entry_digest()).
+ */
+static struct cache_entry *map_file(const char *filename, int fd,
+                                    const struct stat *st,
+                                    unsigned long gen) {
+    char hex[MD5_HEX_LEN + 1];
+    if (!S_ISREG(st->st_mode) || st->st_size == 0)
+        return NULL;
+    if (digest_load(fd, st, hex) < 0)
+        hex[0] = '\0';
+    char *map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    return cache_insert_map(cache, filename, map, st, hex, gen);
+}
+
+/*
+ * same_file() - whether st describes the file that a mapping is of, and
+ *               it is unmodified
+ */
+static int same_file(const struct cache_entry *e, const struct stat *st) {
+    return st->st_dev == e->dev && st->st_ino == e->ino &&
+           (size_t)st->st_size == e->size &&
+           st->st_mtim.tv_sec == e->mtime.tv_sec &&
+           st->st_mtim.tv_nsec == e->mtime.tv_nsec;
+}
+
+/*
+ * current() - whether a cache entry still holds what is at its key: a
+ *             mapping is only good while the name leads to the same,
+ *             unmodified file
+ */
+static int current(const struct cache_entry *e) {
+    struct stat st;
+    if (!e->mapped)
+        return 1;
+    return stat(e->key, &st) == 0 && same_file(e, &st);
+}
+
+/*
+ * entry_digest() - the MD5 of a cached file, in hex ("" if it can't be
+ *                  had).  A mapping cached without one is hashed from
+ *                  memory now, and the MD5 stored with the file, and the
+ *                  entry is swapped for one that carries it, so that only
+ *                  the first request to want it pays.
+ */
+static void entry_digest(struct cache_entry **ep, char *hex) {
+    struct cache_entry *e = *ep;
+    struct stat st;
+    strcpy(hex, e->digest);
+    if (hex[0] || !e->mapped)
+        return;
+
+    /* only a mapping of what is still there may be replaced */
+    unsigned long gen = cache_generation(cache, e->key);
+    int fd = open(e->key, O_RDONLY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || !same_file(e, &st)) {
+        close(fd);
+        return;
+    }
+    if (digest_load(fd, &st, hex) < 0) {
+        EVP_MD_CTX *md5 = hash_begin(EVP_md5());
+        hash_update(md5, e->data, e->size);
+        if (md5 == NULL || hash_end(md5, hex) < 0) {
+            hex[0] = '\0';
+            close(fd);
+            return;
+        }
+        digest_store(fd, hex);
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    struct cache_entry *with = cache_insert_map(cache, e->key, map, &st, hex,
+                                                gen);
+    if (with) {
+        cache_release(cache, e);
+        *ep = with;
+    }
+}
+
+/*
+ * fill_file() - cache the whole of a file, already read into data, which
+ *               the cache takes over.  A file without a stored digest is
+ *               hashed on the way in, so that cached files always have one.
+ */
+static struct cache_entry *fill_file(const char *filename, int fd,
+                                     const struct stat *st, char *data,
+                                     unsigned long gen) {
+    char hex[MD5_HEX_LEN + 1];
+    if (digest_load(fd, st, hex) < 0) {
+        EVP_MD_CTX *md5 = hash_begin(EVP_md5());
+        hash_update(md5, data, st->st_size);
+        if (md5 && hash_end(md5, hex) == 0)
+            digest_store(fd, hex);
+        else
+            hex[0] = '\0';
+    }
+    return cache_insert(cache, filename, data, st->st_size, hex, gen);
+}
+
+/*
+ * load_file() - read a whole file into a cache entry, or return NULL if it
+ *               can't be cached
+ */
+static struct cache_entry *load_file(const char *filename, int fd,
+                                     const struct stat *st,
+                                     unsigned long gen) {
+    if (map_files)
+        return map_file(filename, fd, st, gen);
+    size_t size = st->st_size;
+    if (!cache_fits(cache, size))
+        return NULL;
+    char *data = malloc(size ? size : 1);
+    if (data == NULL)
+        return NULL;
+    size_t have = 0;
+    while (have < size) {
+        ssize_t n = pread(fd, data + have, size - have, have);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        have += n;
+    }
+    return fill_file(filename, fd, st, data, gen);
+}
+
+/*
+ * key_generation() - the generation to cache a file just opened under key
+ *                    with, given gen, taken for its name before the open.
+ *                    A blob's contents never change, so its shard's can
+ *                    be taken now.
+ */
+static unsigned long key_generation(const char *key, const char *filename,
+                                    unsigned long gen) {
+    return key == filename ? gen : cache_generation(cache, key);
+}
+
+/*
+ * close_body() - release whatever a body holds
+ */
+static void close_body(struct body *b) {
+    if (b->entry)
+        cache_release(cache, b->entry);
+    if (b->fd >= 0)
+        close(b->fd);
+    b->entry = NULL;
+    b->data = NULL;
+    b->fd = -1;
+}
+
+/*
+ * cache_key() - the key a GET of filename looks up: its blob's path if it
+ *               is in the content store
+ */
+static const char *cache_key(const char *filename, char *blob) {
+    return store_lookup(filename, blob) == 0 ? blob : filename;
+}
+
+/*
+ * open_body() - find a file's contents for a response, in the cache or on
+ *               disk, and trim them to the length bytes at offset, or to
+ *               everything from offset when length is -1.  The size of the
+ *               whole file goes in total, and, unless digest is NULL, its
+ *               MD5 goes in digest ("" if it can't be had).  The cache
+ *               lookup is counted unless it already has been.  Returns NULL
+ *               on success, or the error message to send.
+ */
+static const char *open_body(const char *filename, struct body *b,
+                             off_t offset, long length, size_t *total,
+                             char *digest, int counted) {
+    memset(b, 0, sizeof(*b));
+    b->fd = -1;
+
+    /* files in the content store are cached by content, so names with the
+       same content share one copy */
+    char blob[PATH_MAX];
+    const char *key = cache ? cache_key(filename, blob) : filename;
+
+    /* serve hot files straight from memory */
+    unsigned long gen = 0;
+    if (cache) {
+        b->entry = cache_get(cache, key);
+        if (b->entry && !current(b->entry)) {
+            cache_release(cache, b->entry);
+            b->entry = NULL;
+        }
+        if (!counted)
+            stats_cache(b->entry != NULL);
+        if (b->entry) {
+            if (digest)
+                entry_digest(&b->entry, digest);
+            b->data = b->entry->data;
+            *total = b->entry->size;
+            goto trim;
+        }
+        gen = cache_generation(cache, filename);
+    }
+
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return GET_NOT_FOUND;
+    if (fstat(fd, &st) < 0 || S_ISDIR(st.st_mode) ||
+        (offset && !S_ISREG(st.st_mode))) {
+        close(fd);
+        return GET_UNREADABLE;
+    }
+    *total = st.st_size;
+
+    /* the name may have changed hands since it was looked up */
+    key = store_lookup_fd(fd, blob) == 0 ? blob : filename;
+    if (cache && (b->entry = load_file(key, fd, &st,
+                                       key_generation(key, filename, gen)))) {
+        close(fd);
+        if (digest)
+            entry_digest(&b->entry, digest);
+        b->data = b->entry->data;
+    }
+    else {
+        b->fd = fd;
+        b->xfer = S_ISREG(st.st_mode) ? XFER_SENDFILE : XFER_SPLICE_STREAM;
+        if (digest && file_digest(fd, &st, digest) < 0)
+            digest[0] = '\0';
+    }
+
+trim:
+    if ((size_t)offset > *total) {
+        close_body(b);
+        return GET_UNSATISFIABLE;
+    }
+    b->offset = offset;
+    b->length = *total - offset;
+    if (length >= 0 && (size_t)length < b->length)
+        b->length = length;
+    return NULL;
+}
+
+void request_cached(void (*fn)(const struct cache_entry *e, void *arg),
+                    void *arg) {
+    if (cache)
+        cache_walk(cache, fn, arg);
+}
+
+int request_prefetch(struct request *req) {
+    if (cache == NULL || map_files || store_enabled() ||
+        req->type != REQ_GET || cache_has(cache, req->filename))
+        return 0;
+    req->prefetched = 1;
+    stats_cache(0);
+    return 1;
+}
+
+int request_blocks(const struct request *req) {
+    if (req->type == REQ_STATS)
+        return 0;
+    return req->type != REQ_GET || cache == NULL || map_files ||
+           !cache_has(cache, req->filename);
+}
+
+unsigned long request_generation(const char *key) {
+    return cache ? cache_generation(cache, key) : 0;
+}
+
+int prefetch_begin(struct prefetch *pf, int fd, unsigned long gen) {
+    memset(pf, 0, sizeof(*pf));
+    pf->fd = fd;
+    if (fstat(fd, &pf->st) < 0 || !S_ISREG(pf->st.st_mode) ||
+        !cache_fits(cache, pf->st.st_size) ||
+        (pf->data = malloc(pf->st.st_size ? pf->st.st_size : 1)) == NULL) {
+        close(fd);
+        pf->fd = -1;
+        return -1;
+    }
+    pf->size = pf->st.st_size;
+    pf->gen = gen;
+    return 0;
+}
+
+void prefetch_end(struct prefetch *pf, const struct request *req) {
+    char blob[PATH_MAX];
+    if (pf->fd < 0)
+        return;
+    if (pf->have == pf->size) {
+        /* the name may have changed hands since it was looked up */
+        const char *key = store_lookup_fd(pf->fd, blob) == 0 ? blob
+                                                            : req->filename;
+        struct cache_entry *e = fill_file(key, pf->fd, &pf->st, pf->data,
+                                          key_generation(key, req->filename,
+                                                         pf->gen));
+        if (e)
+            cache_release(cache, e);
+    }
+    else
+        free(pf->data);
+    close(pf->fd);
+    pf->fd = -1;
+    pf->data = NULL;
+}
+
+int request_warm(const char *key, int fd, const char *digest,
+                 unsigned long gen) {
+    struct stat st;
+    char hex[MD5_HEX_LEN + 1], blob[PATH_MAX];
+    if (cache == NULL || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+    /* a file rewritten since is not the one that was hot */
+    if (digest && digest_load(fd, &st, hex) == 0 && strcmp(hex, digest) != 0)
+        return -1;
+    /* nor is a name that has since been linked to other content */
+    if (store_lookup_fd(fd, blob) == 0 && strcmp(blob, key) != 0)
+        return -1;
+    struct cache_entry *e = cache_get(cache, key);
+    if (e == NULL)
+        e = load_file(key, fd, &st, gen);
+    if (e == NULL)
+        return -1;
+    cache_release(cache, e);
+    return 0;
+}
+
+/*
+ * deflate_key() - the cache key for the compressed form of a file; no
+ *                 filename can contain a newline, so it can't collide
+ */
+static char *deflate_key(const char *key) {
+    char *zkey;
+    if (asprintf(&zkey, "%s\ndeflate", key) < 0)
+        return NULL;
+    return zkey;
+}
+
+/*
+ * forget() - drop every cached form of a file whose contents have changed
+ */
+static void forget(const char *filename) {
+    char *zkey = deflate_key(filename);
+    cache_invalidate(cache, filename);
+    if (zkey)
+        cache_invalidate(cache, zkey);
+    free(zkey);
+}
+
+/*
+ * deflate_entry() - the compressed frames of a cached file, themselves
+ *                   cached, so that a hot file is compressed only once.
+ *                   Returns a referenced entry, or NULL if they can't be
+ *                   cached.
+ */
+static struct cache_entry *deflate_entry(struct cache_entry *e) {
+    char *zkey = deflate_key(e->key);
+    if (zkey == NULL)
+        return NULL;
+    /* frames made from other contents, which a mapping replaced behind
+       our back, don't count */
+    struct cache_entry *ze = cache_get(cache, zkey);
+    if (ze && e->digest[0] && strcmp(ze->digest, e->digest) == 0) {
+        free(zkey);
+        return ze;
+    }
+    if (ze)
+        cache_release(cache, ze);
+
+    /* only frames made from the current contents may be cached */
+    unsigned long gen = cache_generation(cache, zkey);
+    struct cache_entry *now = cache_get(cache, e->key);
+    if (now)
+        cache_release(cache, now);
+    size_t chunks = e->size / FRAME_RAW_MAX + 1;
+    char *data = NULL;
+    if (now == e)
+        data = malloc(chunks * frame_bound(FRAME_RAW_MAX) + FRAME_HDR);
+    if (data == NULL) {
+        free(zkey);
+        return NULL;
+    }
+    size_t len = 0;
+    for (size_t off = 0; off < e->size; off += FRAME_RAW_MAX) {
+        size_t n = e->size - off < FRAME_RAW_MAX ? e->size - off
+                                                 : FRAME_RAW_MAX;
+        len += frame_encode(e->data + off, n, data + len);
+    }
+    len += frame_end(data + len);
+    char *shrunk = realloc(data, len);
+    ze = cache_insert(cache, zkey, shrunk ? shrunk : data, len,
+                      e->digest[0] ? e->digest : NULL, gen);
+    free(zkey);
+    return ze;
+}
+
+/*
+ * compress_body() - send a GET's body as compressed frames: from the cache
+ *                   for a whole cached file, and otherwise made as the body
+ *                   is sent
+ */
+static void compress_body(struct response *resp, int whole) {
+    struct body *b = &resp->single;
+    struct cache_entry *ze;
+    char hex[MD5_HEX_LEN + 1];
+
+    /* cached frames are matched to the file by its MD5 */
+    if (whole && b->entry) {
+        entry_digest(&b->entry, hex);
+        b->data = b->entry->data;
+    }
+    if (whole && b->entry && (ze = deflate_entry(b->entry)) != NULL) {
+        cache_release(cache, b->entry);
+        b->entry = ze;
+        b->data = ze->data;
+        b->offset = 0;
+        b->length = ze->size;
+    }
+    else {
+        b->xfer = XFER_DEFLATE;
+        b->length += FRAME_HDR;
+    }
+    resp->length = b->length;
+}
+
+void response_init(struct response *resp) {
+    memset(resp, 0, sizeof(*resp));
+    resp->pipe[0] = resp->pipe[1] = -1;
+}
+
+const char *prepare_get(struct request *req, struct response *resp,
+                        struct arena *arena) {
+    const char *err;
+    size_t total;
+    char digest[MD5_HEX_LEN + 1];
+    int want_digest = req->want_digest || req->match;
+    response_init(resp);
+    if ((err = open_body(req->filename, &resp->single,
+                         req->ranged ? req->offset : 0,
+                         req->ranged ? req->length : -1, &total,
+                         want_digest ? digest : NULL,
+                         req->prefetched)) != NULL)
+        return err;
+
+    /* the client's copy is current: no need to send it again */
+    if (req->match && digest[0] && strcasecmp(req->match, digest) == 0) {
+        close_body(&resp->single);
+        int len;
+        resp->header = arena_printf(arena, &len, "NOT MODIFIED\n%s\n",
+                                    req->filename);
+        if (resp->header == NULL)
+            return GET_UNREADABLE;
+        resp->headersize = len + 1;
+        return NULL;
+    }
+    resp->bodies = &resp->single;
+    resp->nbodies = 1;
+    resp->length = resp->single.length;
+    size_t length = resp->length;
+    if (req->compress)
+        compress_body(resp, !req->ranged);
+
+    /* optional lines follow the fixed ones */
+    char range[64] = "", md5[MD5_HEX_LEN + 6] = "";
+    if (req->ranged)
+        sprintf(range, "Range %ld %zu\n", req->offset, total);
+    if (want_digest && digest[0])
+        sprintf(md5, "MD5 %s\n", digest);
+
+    /* the header is sent with its terminating NUL */
+    int len;
+    resp->header = arena_printf(arena, &len, "OK\n%s\n%zu\n%s%s%s",
+                                req->filename, length, range, md5,
+                                req->compress ? "Compress deflate\n" : "");
+    if (resp->header == NULL) {
+        response_free(resp);
+        return GET_UNREADABLE;
+    }
+    resp->headersize = len + 1;
+    return NULL;
+}
+
+const char *prepare_mget(struct request *req, struct response *resp,
+                         struct arena *arena) {
+    response_init(resp);
+
+    /* split out the names, and bound the header: a status, a size and
+       spaces around the name come to less than MGET_LINE per file */
+    char *names[MGET_MAX], *saveptr;
+    int count = 0;
+    size_t room = sizeof("OK\n\n") + 11;
+    for (char *name = strtok_r(req->names, "\n", &saveptr); name;
+         name = strtok_r(NULL, "\n", &saveptr)) {
+        if (count == MGET_MAX)
+            return TOO_MANY_FILES;
+        names[count++] = name;
+        room += strlen(name) + MGET_LINE;
+    }
+    char *header = arena_alloc(arena, room);
+    resp->bodies = arena_alloc(arena, count * sizeof(struct body));
+    if (header == NULL || resp->bodies == NULL)
+        return MGET_UNREADABLE;
+    memset(resp->bodies, 0, count * sizeof(struct body));
+    resp->nbodies = count;
+
+    /* open everything, and describe each file in the header */
+    size_t len = sprintf(header, "OK\n%d\n", count);
+    for (int i = 0; i < count; i++) {
+        struct body *b = &resp->bodies[i];
+        size_t total;
+        const char *err = open_body(names[i], b, 0, -1, &total, NULL, 0);
+        if (err == NULL) {
+            len += sprintf(header + len, "OK %zu %s\n", b->length, names[i]);
+            resp->length += b->length;
+        }
+        else {
+            b->fd = -1;
+            b->length = 0;
+            len += sprintf(header + len, "%s 0 %s\n",
+                           request_error(err) == ERR_NOT_FOUND ? "NOTFOUND"
+                                                             : "ERROR",
+                           names[i]);
+        }
+    }
+    /* the header is sent with its terminating NUL */
+    resp->header = header;
+    resp->headersize = len + 1;
+    return NULL;
+}
+
+/*
+ * install() - move a finished upload with the given MD5 into place, through
+ *             the content store when sha256 is not NULL, and update the
+ *             cache.  Returns 0, or -1 if it could not be moved.
+ */
+static int install(const char *tmpname, const char *filename,
+                           const char *sha256, const char *digest,
+                           const char *data, size_t size, int whole) {
+    char blob[PATH_MAX];
+    if (sha256 == NULL) {
+        if (rename(tmpname, filename) < 0)
+            return -1;
+    }
+    else if (store_commit(tmpname, filename, sha256) < 0)
+        return -1;
+    if (cache == NULL)
+        return 0;
+
+    /* a stored file's contents are cached under its blob, which never
+       changes, so only its name's old entries can be stale */
+    forget(filename);
+    if (whole) {
+        if (sha256)
+            store_path(sha256, blob);
+        cache_update(cache, sha256 ? blob : filename, data, size,
+                     digest[0] ? digest : NULL);
+    }
+    return 0;
+}
+
+/*
+ * open_dirs() - open the directories whose entries installing filename
+ *               changed: its own, and the store's too if its SHA-256 is
+ *               given.  Returns how many, into dirs, or -1 on failure.
+ */
+static int open_dirs(const char *filename, const char *sha256, int *dirs) {
+    char path[PATH_MAX];
+    int n = 0;
+    for (int i = 0; i < 2; i++) {
+        if (i == 0)
+            snprintf(path, sizeof(path), "%s", filename);
+        else if (sha256)
+            store_path(sha256, path);
+        else
+            break;
+        if ((dirs[n] = open(dirname(path), O_RDONLY | O_DIRECTORY)) < 0) {
+            while (n > 0)
+                close(dirs[--n]);
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ * sync_names() - make what installing filename did to its directories
+ *                durable, if anything is to be, or if req defers that,
+ *                leave them open in resp for the caller.  Returns 0, or -1
+ *                on failure.
+ */
+static int sync_names(const struct request *req, struct response *resp,
+                      const char *filename, const char *sha256) {
+    int dirs[2], n;
+    if (durable_mode() == DURABLE_NONE)
+        return 0;
+    if (req->defer_sync) {
+        n = open_dirs(filename, sha256, resp->dirs);
+        resp->ndirs = n < 0 ? 0 : n;
+        return n < 0 ? -1 : 0;
+    }
+    if ((n = open_dirs(filename, sha256, dirs)) < 0)
+        return -1;
+    int rc = durable_sync(dirs, n, 1);
+    while (n > 0)
+        close(dirs[--n]);
+    return rc;
+}
+
+const char *prepare_sum(struct request *req, struct response *resp,
+                        struct arena *arena) {
+    char hex[MD5_HEX_LEN + 1];
+    struct stat st;
+    response_init(resp);
+    int fd = open(req->filename, O_RDONLY);
+    if (fd < 0)
+        return SUM_NOT_FOUND;
+    int bad = fstat(fd, &st) < 0 || file_digest(fd, &st, hex) < 0;
+    close(fd);
+    if (bad)
+        return SUM_UNREADABLE;
+
+    /* the header is sent with its terminating NUL */
+    int len;
+    resp->header = arena_printf(arena, &len, "OK\n%s\n%ld\n%s\n",
+                                req->filename, (long)st.st_size, hex);
+    if (resp->header == NULL)
+        return SUM_UNREADABLE;
+    resp->headersize = len + 1;
+    return NULL;
+}
+
+const char *prepare_commit(struct request *req, struct response *resp,
+                           struct arena *arena) {
+    char hex[MD5_HEX_LEN + 1];
+    char *partname = hidden_name(req->filename, ".part");
+    if (partname == NULL)
+        return COMMIT_UNWRITABLE;
+    int fd = open(partname, O_RDONLY);
+    if (fd < 0) {
+        free(partname);
+        return NO_RANGES;
+    }
+
+    /* a bad upload is thrown away, so the client starts over cleanly */
+    struct stat st;
+    const char *err = NULL;
+    char sha256[SHA256_HEX_LEN + 1];
+    int stored = 0;
+    if (fstat(fd, &st) < 0 || st.st_size != req->filesize ||
+        hash_fd(fd, st.st_size, EVP_md5(), hex) < 0 ||
+        strcasecmp(hex, req->digest))
+        err = COMMIT_MISMATCH;
+    else {
+        stored = store_enabled() &&
+                 hash_fd(fd, st.st_size, EVP_sha256(), sha256) == 0;
+        digest_store(fd, hex);
+        if (install(partname, req->filename, stored ? sha256 : NULL, hex,
+                    NULL, 0, 0) < 0)
+            err = COMMIT_UNWRITABLE;
+    }
+    close(fd);
+    if (err)
+        unlink(partname);
+    free(partname);
+    if (err)
+        return err;
+    /* the ranges' data was made durable as each was acknowledged */
+    if (response_ok(resp, req->want_digest ? hex : NULL, arena) < 0 ||
+        sync_names(req, resp, req->filename, stored ? sha256 : NULL) < 0)
+        return COMMIT_UNWRITABLE;
+    return NULL;
+}
+
+const char *prepare_link(struct request *req, struct response *resp,
+                         struct arena *arena) {
+    response_init(resp);
+    char *tmpname = hidden_name(req->filename, ".XXXXXX");
+    int fd = tmpname ? mkstemp(tmpname) : -1;
+    if (fd < 0) {
+        free(tmpname);
+        return LINK_UNWRITABLE;
+    }
+    close(fd);
+    int rc = store_link(tmpname, req->filename, req->digest);
+    int missing = rc < 0 && errno == ENOENT;
+    if (rc < 0)
+        unlink(tmpname);
+    free(tmpname);
+
+    /* not an error: the client just has to send the bytes after all */
+    if (missing) {
+        resp->header = "MISSING\n";
+        resp->headersize = sizeof("MISSING\n");
+        return NULL;
+    }
+    if (rc < 0)
+        return LINK_UNWRITABLE;
+    if (cache)
+        forget(req->filename);
+    if (response_ok(resp, NULL, arena) < 0 ||
+        sync_names(req, resp, req->filename, NULL) < 0)
+        return LINK_UNWRITABLE;
+    return NULL;
+}
+
+const char *prepare_stats(struct request *req, struct response *resp,
+                          struct arena *arena) {
+    response_init(resp);
+    char *text = stats_format();
+    int len;
+    if (text)
+        resp->header = arena_printf(arena, &len, "OK\n%s", text);
+    free(text);
+    if (resp->header == NULL)
+        return STATS_UNAVAILABLE;
+    /* the header is sent with its terminating NUL */
+    resp->headersize = len + 1;
+    return NULL;
+}
+
+const char *prepare_response(struct request *req, struct response *resp,
+                             struct arena *arena) {
+    switch (req->type) {
+      case REQ_GET:    return prepare_get(req, resp, arena);
+      case REQ_MGET:   return prepare_mget(req, resp, arena);
+      case REQ_SUM:    return prepare_sum(req, resp, arena);
+      case REQ_COMMIT: return prepare_commit(req, resp, arena);
+      case REQ_LINK:   return prepare_link(req, resp, arena);
+      case REQ_STATS:  return prepare_stats(req, resp, arena);
+      default:         break;
+    }
+    return BAD_TYPE;
+}
+
+/*
+ * splice_body() - move file bytes to the socket through a pipe, for files
+ *                 that sendfile() can't read
+ */
+static ssize_t splice_body(int sockfd, struct response *resp,
+                           struct body *b) {
+    if (resp->pipe[0] < 0 && pipe2(resp->pipe, O_NONBLOCK) < 0)
+        return -1;
+    if (resp->piped == 0) {
+        loff_t *off = b->xfer == XFER_SPLICE ? &b->offset : NULL;
+        ssize_t n = splice(b->fd, off, resp->pipe[1], NULL, b->length,
+                           SPLICE_F_MOVE);
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;    /* file shrank under us */
+            return -1;
+        }
+        resp->piped = n;
+    }
+    ssize_t n = splice(resp->pipe[0], NULL, sockfd, NULL, resp->piped,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n > 0) {
+        resp->piped -= n;
+        b->length -= n;
+    }
+    return n;
+}
+
+/*
+ * next_frame() - compress the next chunk of a body into resp->zbuf, or the
+ *                closing frame once there is nothing left
+ */
+static int next_frame(struct response *resp, struct body *b) {
+    size_t left = b->length - FRAME_HDR;
+    size_t n = left < FRAME_RAW_MAX ? left : FRAME_RAW_MAX;
+    if (resp->zbuf == NULL && (resp->zbuf = buffer_get()) == NULL)
+        return -1;
+    resp->zoff = 0;
+    if (n == 0) {
+        resp->zlen = frame_end(resp->zbuf);
+        resp->zunits = FRAME_HDR;
+        return 0;
+    }
+
+    const char *raw = b->data ? b->data + b->offset : NULL;
+    if (raw == NULL) {
+        if (resp->zraw == NULL && (resp->zraw = buffer_get()) == NULL)
+            return -1;
+        for (size_t got = 0; got < n; ) {
+            ssize_t r = pread(b->fd, resp->zraw + got, n - got,
+                              b->offset + got);
+            if (r < 0 && errno == ESPIPE)
+                r = read(b->fd, resp->zraw + got, n - got);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                if (r == 0)
+                    errno = EIO;    /* file shrank under us */
+                return -1;
+            }
+            got += r;
+        }
+        raw = resp->zraw;
+    }
+    resp->zlen = frame_encode(raw, n, resp->zbuf);
+    resp->zunits = n;
+    b->offset += n;
+    return 0;
+}
+
+/*
+ * deflate_body() - send a body as compressed frames, made a chunk at a time.
+ *                  Its length only drops as each frame finishes going out.
+ */
+static ssize_t deflate_body(int sockfd, struct response *resp,
+                            struct body *b) {
+    if (resp->zoff == resp->zlen && next_frame(resp, b) < 0)
+        return -1;
+    int more = resp->zunits < b->length ? MSG_MORE : 0;
+    ssize_t n = send(sockfd, resp->zbuf + resp->zoff,
+                     resp->zlen - resp->zoff, MSG_NOSIGNAL | more);
+    if (n > 0)
+        stats_bytes_out(n);
+    if (n > 0 && (resp->zoff += n) == resp->zlen) {
+        b->length -= resp->zunits;
+        resp->length -= resp->zunits;
+    }
+    return n;
+}
+
+ssize_t send_body(int sockfd, struct response *resp) {
+    ssize_t n;
+    while (resp->cur < resp->nbodies && resp->bodies[resp->cur].length == 0)
+        close_body(&resp->bodies[resp->cur++]);
+    if (resp->cur == resp->nbodies)
+        return 0;
+
+    struct body *b = &resp->bodies[resp->cur];
+    if (b->xfer == XFER_DEFLATE)
+        return deflate_body(sockfd, resp, b);
+    if (b->data) {
+        /* let the kernel pack the next body in behind this one */
+        int more = resp->length > b->length ? MSG_MORE : 0;
+        n = send(sockfd, b->data + b->offset, b->length, MSG_NOSIGNAL | more);
+        if (n > 0) {
+            b->offset += n;
+            b->length -= n;
+        }
+    }
+    else {
+        n = -1;
+        if (b->xfer == XFER_SENDFILE) {
+            n = sendfile(sockfd, b->fd, &b->offset, b->length);
+            if (n > 0)
+                b->length -= n;
+            if (n == 0) {
+                errno = EIO;    /* file shrank under us */
+                n = -1;
+            }
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+                b->xfer = XFER_SPLICE;
+        }
+        if (b->xfer != XFER_SENDFILE)
+            n = splice_body(sockfd, resp, b);
+    }
+    if (n > 0) {
+        resp->length -= n;
+        stats_bytes_out(n);
+    }
+    return n;
+}
+
+ssize_t response_send(int sockfd, struct response *resp) {
+    size_t headlen = sizeof(resp->prefix) + resp->headersize;
+    if (resp->headsent == headlen)
+        return send_body(sockfd, resp);
+
+    /* whatever is left of the length and header */
+    struct iovec iov[3];
+    int n = 0;
+    resp->prefix = resp->headersize;
+    if (resp->headsent < sizeof(resp->prefix))
+        iov[n++] = (struct iovec){
+            (char *)&resp->prefix + resp->headsent,
+            sizeof(resp->prefix) - resp->headsent };
+    size_t off = resp->headsent > sizeof(resp->prefix)
+                 ? resp->headsent - sizeof(resp->prefix) : 0;
+    iov[n++] = (struct iovec){ (char *)resp->header + off,
+                               resp->headersize - off };
+
+    /* and the first body, if it is in memory */
+    struct body *b = resp->cur < resp->nbodies ? &resp->bodies[resp->cur]
+                                               : NULL;
+    if (b && b->data && b->xfer != XFER_DEFLATE && b->length)
+        iov[n++] = (struct iovec){ (char *)b->data + b->offset, b->length };
+    else
+        b = NULL;
+    int more = resp->length > (b ? b->length : 0) ? MSG_MORE : 0;
+
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+    ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL | more);
+    if (sent <= 0)
+        return sent;
+    size_t head = headlen - resp->headsent;
+    if ((size_t)sent < head)
+        head = sent;
+    resp->headsent += head;
+    if (sent > (ssize_t)head) {
+        b->offset += sent - head;
+        b->length -= sent - head;
+        resp->length -= sent - head;
+        stats_bytes_out(sent - head);
+    }
+    return sent;
+}
+
+int response_sent(const struct response *resp) {
+    return resp->headsent == sizeof(resp->prefix) + resp->headersize &&
+           resp->length == 0;
+}
+
+int response_blocks(const struct response *resp) {
+    for (int i = resp->cur; i < resp->nbodies; i++) {
+        const struct body *b = &resp->bodies[i];
+        if (b->length)
+            return b->data == NULL || (b->entry && b->entry->mapped);
+    }
+    return 0;
+}
+
+ssize_t reader_recv(struct reader *r, int fd, void *dst, size_t len) {
+    if (r->buf == NULL) {
+        /* a big read gains nothing from going through the buffer */
+        if (len >= READ_AHEAD / 2)
+            return recv(fd, dst, len, 0);
+        if ((r->buf = buffer_get()) == NULL)
+            return -1;
+        ssize_t n = recv(fd, r->buf, READ_AHEAD, 0);
+        if (n <= 0) {
+            reader_free(r);
+            return n;
+        }
+        r->start = 0;
+        r->end = n;
+    }
+    size_t n = r->end - r->start;
+    if (n > len)
+        n = len;
+    memcpy(dst, r->buf + r->start, n);
+    if ((r->start += n) == r->end)
+        reader_free(r);
+    return n;
+}
+
+void reader_free(struct reader *r) {
+    buffer_put(r->buf);
+    r->buf = NULL;
+    r->start = r->end = 0;
+}
+
+const char *put_begin(struct request *req, struct put_sink *sink) {
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = -1;
+    sink->remaining = req->filesize;
+    sink->ranged = req->ranged;
+    sink->compressed = req->compress;
+    if (sink->compressed) {
+        sink->remaining = 1;
+        sink->raw = req->filesize;
+        if ((sink->zbuf = buffer_get()) == NULL)
+            return PUT_UNWRITABLE;
+    }
+
+    /* the temporary file must be in the same directory for rename(); the
+       ranges of one upload all go into the same staging file */
+    sink->tmpname = hidden_name(req->filename,
+                                req->ranged ? ".part" : ".XXXXXX");
+    if (sink->tmpname == NULL)
+        return PUT_UNWRITABLE;
+    if (req->ranged)
+        sink->fd = open(sink->tmpname, O_WRONLY | O_CREAT, put_mode);
+    else
+        sink->fd = mkstemp(sink->tmpname);
+    if (sink->fd < 0 || fchmod(sink->fd, put_mode) < 0 ||
+        (req->ranged && ftruncate(sink->fd, req->length) < 0) ||
+        (sink->buf = buffer_get()) == NULL) {
+        put_abort(sink);
+        return PUT_UNWRITABLE;
+    }
+    /* COMMIT hashes a ranged upload once all of its ranges are in */
+    if (req->ranged)
+        sink->offset = req->offset;
+    else {
+        sink->md5 = hash_begin(EVP_md5());
+        if (store_enabled())
+            sink->sha256 = hash_begin(EVP_sha256());
+    }
+    return NULL;
+}
+
+char *put_space(struct put_sink *sink, size_t *len) {
+    if (sink->compressed) {
+        if (sink->fhave < FRAME_HDR) {
+            *len = FRAME_HDR - sink->fhave;
+            return sink->frame + sink->fhave;
+        }
+        *len = sink->zlen - sink->zhave;
+        return sink->zbuf + sink->zhave;
+    }
+    size_t room = PUT_CHUNK - sink->have;
+    *len = (size_t)sink->remaining < room ? (size_t)sink->remaining : room;
+    return sink->buf + sink->have;
+}
+
+/*
+ * put_flush() - hash and write out whatever the sink is holding.  Unless
+ *               this is the last of the body, a spilled buffer is replaced;
+ *               the last stays, for put_commit() to cache.
+ */
+static int put_flush(struct put_sink *sink, int last) {
+    char *p = sink->buf;
+    size_t len = sink->have;
+    off_t offset = sink->offset;
+    hash_update(sink->md5, p, len);
+    hash_update(sink->sha256, p, len);
+    if (len == 0)
+        return 0;
+    sink->have = 0;
+    sink->offset += len;
+
+    if (sink->spill) {
+        if (!last && (sink->buf = buffer_get()) == NULL) {
+            sink->buf = p;
+            return -1;
+        }
+        if (sink->spill(sink->owner, p, len, offset) == 0)
+            return 0;
+        if (!last)
+            buffer_put(p);
+        return -1;
+    }
+    while (len) {
+        ssize_t n = pwrite(sink->fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * put_frame() - take in what arrived of a compressed body, expanding each
+ *               frame into the chunk buffer once all of it is here
+ */
+static int put_frame(struct put_sink *sink, size_t n) {
+    uint32_t complen, rawlen;
+    if (sink->fhave < FRAME_HDR) {
+        if ((sink->fhave += n) < FRAME_HDR)
+            return 0;
+        if (frame_header(sink->frame, &complen, &rawlen) < 0)
+            return -1;
+        sink->zlen = complen;
+        sink->zraw = rawlen;
+        sink->zhave = 0;
+        if (complen == 0) {
+            /* the closing frame: the body must be the size promised */
+            if (sink->raw != 0)
+                return -1;
+            sink->remaining = 0;
+            return 0;
+        }
+        return rawlen > sink->raw ? -1 : 0;
+    }
+    if ((sink->zhave += n) < sink->zlen)
+        return 0;
+
+    if (sink->have + sink->zraw > PUT_CHUNK) {
+        sink->spilled = 1;
+        if (put_flush(sink, 0) < 0)
+            return -1;
+    }
+    if (frame_decode(sink->zbuf, sink->zlen, sink->zraw,
+                     sink->buf + sink->have) < 0)
+        return -1;
+    sink->have += sink->zraw;
+    sink->raw -= sink->zraw;
+    sink->fhave = 0;
+    return 0;
+}
+
+int put_received(struct put_sink *sink, size_t n) {
+    stats_bytes_in(n);
+    if (sink->compressed)
+        return put_frame(sink, n);
+    sink->have += n;
+    sink->remaining -= n;
+    if (sink->have < PUT_CHUNK)
+        return 0;
+    sink->spilled = 1;
+    return put_flush(sink, 0);
+}
+
+int put_drain(struct put_sink *sink) {
+    return put_flush(sink, 1);
+}
+
+void put_spilled(struct put_sink *sink, char *buf, int ok) {
+    if (!ok)
+        sink->failed = 1;
+    if (buf != sink->buf)
+        buffer_put(buf);
+}
+
+const char *put_commit(struct request *req, struct put_sink *sink) {
+    const char *err;
+    if ((err = put_finish(sink)) != NULL)
+        return err;
+    if (durable_sync(&sink->fd, 1, 0) < 0) {
+        put_abort(sink);
+        return PUT_UNWRITABLE;
+    }
+    if ((err = put_install(req, sink)) != NULL)
+        return err;
+    /* too late to take the upload back, but the client mustn't count on
+       it */
+    if (durable_sync(sink->dirs, sink->ndirs, 1) < 0)
+        err = PUT_UNWRITABLE;
+    put_close(sink);
+    return err;
+}
+
+const char *put_finish(struct put_sink *sink) {
+    if (sink->failed || put_drain(sink) < 0) {
+        put_abort(sink);
+        return PUT_UNWRITABLE;
+    }
+    /* keep the digest with the file, for GETs to come */
+    sink->digest[0] = '\0';
+    if (sink->md5 && hash_end(sink->md5, sink->digest) == 0)
+        digest_store(sink->fd, sink->digest);
+    sink->md5 = NULL;
+    return NULL;
+}
+
+const char *put_install(struct request *req, struct put_sink *sink) {
+    /* a body that fit in one chunk can go straight into the cache */
+    size_t size = sink->offset;
+    int whole = !sink->spilled && !sink->ranged;
+    char sha256[SHA256_HEX_LEN + 1];
+    int stored = hash_end(sink->sha256, sha256) == 0;
+    sink->sha256 = NULL;
+    if (close(sink->fd) < 0) {
+        sink->fd = -1;
+        put_abort(sink);
+        return PUT_UNWRITABLE;
+    }
+    sink->fd = -1;
+
+    /* a range waits in the staging file for its COMMIT */
+    if (!sink->ranged &&
+        install(sink->tmpname, req->filename, stored ? sha256 : NULL,
+                sink->digest, sink->buf, size, whole) < 0) {
+        put_abort(sink);
+        return PUT_UNWRITABLE;
+    }
+    free(sink->tmpname);
+    buffer_put(sink->buf);
+    buffer_put(sink->zbuf);
+    sink->tmpname = sink->buf = sink->zbuf = NULL;
+    if (durable_mode() != DURABLE_NONE &&
+        (sink->ndirs = open_dirs(req->filename, stored ? sha256 : NULL,
+                                 sink->dirs)) < 0) {
+        sink->ndirs = 0;
+        return PUT_UNWRITABLE;
+    }
+    return NULL;
+}
+
+void put_close(struct put_sink *sink) {
+    if (sink->fd >= 0)
+        close(sink->fd);
+    sink->fd = -1;
+    for (int i = 0; i < sink->ndirs; i++)
+        close(sink->dirs[i]);
+    sink->ndirs = 0;
+}
+
+void put_abort(struct put_sink *sink) {
+    put_close(sink);
+    EVP_MD_CTX_free(sink->md5);
+    EVP_MD_CTX_free(sink->sha256);
+    sink->md5 = sink->sha256 = NULL;
+    /* other connections may still be filling a staging file */
+    if (sink->tmpname && !sink->ranged)
+        unlink(sink->tmpname);
+    free(sink->tmpname);
+    buffer_put(sink->buf);
+    buffer_put(sink->zbuf);
+    sink->tmpname = sink->buf = sink->zbuf = NULL;
+}
+
+int response_ok(struct response *resp, const char *digest,
+                struct arena *arena) {
+    response_init(resp);
+    int len;
+    if (digest)
+        resp->header = arena_printf(arena, &len, "OK\nMD5 %s\n", digest);
+    else
+        resp->header = arena_printf(arena, &len, "OK\n");
+    if (resp->header == NULL)
+        return -1;
+    /* the header is sent with its terminating NUL */
+    resp->headersize = len + 1;
+    return 0;
+}
+
+void response_error(struct response *resp, const char *msg) {
+    response_init(resp);
+    resp->header = msg;
+    resp->headersize = strlen(msg);
+}
+
+enum req_error request_error(const char *msg) {
+    for (size_t i = 0; i < sizeof(error_kinds) / sizeof(error_kinds[0]); i++)
+        if (strcmp(msg, error_kinds[i].msg) == 0)
+            return error_kinds[i].kind;
+    return ERR_OTHER;
+}
+
+void response_free(struct response *resp) {
+    resp->header = NULL;
+    for (int i = resp->cur; i < resp->nbodies; i++)
+        close_body(&resp->bodies[i]);
+    resp->bodies = NULL;
+    resp->nbodies = resp->cur = 0;
+    for (int i = 0; i < 2; i++)
+        if (resp->pipe[i] >= 0)
+            close(resp->pipe[i]);
+    resp->pipe[0] = resp->pipe[1] = -1;
+    buffer_put(resp->zraw);
+    buffer_put(resp->zbuf);
+    resp->zraw = resp->zbuf = NULL;
+    resp->zlen = resp->zoff = 0;
+    while (resp->ndirs > 0)
+        close(resp->dirs[--resp->ndirs]);
+}
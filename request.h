@@ -0,0 +1,489 @@
+#ifndef REQUEST_H__
+#define REQUEST_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "arena.h"
+#include "cache.h"
+#include "compress.h"
+#include "digest.h"
+
+/*
+ * The protocol-level half of the file server, shared by the blocking and the
+ * event-driven connection handlers.  The handlers decide when to read and
+ * write; these functions decide what the bytes mean, and how a response body
+ * gets from the file to the socket.
+ */
+
+/* Largest request header we are willing to buffer for a client */
+#define REQ_MAX_HEADER 65536
+
+/* How much of a PUT body a connection buffers before writing it out */
+#define PUT_CHUNK 65536
+
+/* Most files one MGET may ask for, and the most an MGET response header
+   spends on each besides its name */
+#define MGET_MAX  1024
+#define MGET_LINE 32
+
+/* How far ahead of the parser a connection reads */
+#define READ_AHEAD 16384
+
+enum req_type { REQ_GET, REQ_PUT, REQ_MGET, REQ_SUM, REQ_COMMIT, REQ_LINK,
+                REQ_STATS, REQ_NTYPES };
+
+/* Kinds of error response, for counting */
+enum req_error { ERR_BAD_REQUEST, ERR_NOT_FOUND, ERR_RANGE, ERR_DIGEST,
+                 ERR_IO, ERR_OTHER, ERR_NTYPES };
+
+/* Error messages that the connection handlers send themselves */
+#define HEADER_TOO_LARGE  "Request header too large\n"
+#define PUT_UNWRITABLE    "PUT file could not be written\n"
+#define COMMIT_UNWRITABLE "COMMIT file could not be written\n"
+#define LINK_UNWRITABLE   "LINK file could not be written\n"
+
+/*
+ * A parsed request header.  Strings point into the header buffer that was
+ * parsed, so they live exactly as long as it does: for the connection
+ * handlers, until their arena is reset after the response.
+ *
+ * After its fixed lines, a GET or PUT may carry a "Range <offset> <n>" line,
+ * which lets a client move one large file over several connections at once.
+ * For a GET, n is how many bytes to send from offset, and without n the
+ * rest of the file is sent, so a client can resume a download that broke
+ * off.  For a PUT, the body is the bytes at offset of a file n bytes long;
+ * ranges are collected in a staging file beside the target until a COMMIT
+ * moves it into place.
+ *
+ * A "Digest" line asks for the file's MD5 in the response, as a line
+ * "MD5 <hex>" after the others, so the client can check what it received
+ * or what the server stored.  Digests are kept with the files on disk, so
+ * only new or changed files are hashed, and a PUT hashes its body as it is
+ * written.
+ *
+ * A GET may also carry "If-None-Match <md5>", the MD5 of a copy the client
+ * already has.  If the file still has that MD5, the response is a header of
+ * "NOT MODIFIED\n<name>\n" and no body; otherwise the file comes back as
+ * usual, with its MD5 line so the client can remember the new version.
+ *
+ * A "Compress deflate" line on a GET or PUT sends the body as compressed
+ * frames (see compress.h); the header still gives its uncompressed size.
+ * A compressed GET response says so with a "Compress deflate" line.
+ */
+struct request {
+    enum req_type type;
+    char         *filename;     /* for MGET, the first of names */
+    long          filesize;     /* PUT: body bytes to follow; COMMIT: size */
+    char         *names;        /* MGET only: filenames, one per line */
+    char         *digest;       /* COMMIT: expected MD5; LINK: SHA-256 */
+    int           ranged;       /* whether there was a Range line */
+    int           want_digest;  /* whether there was a Digest line */
+    char         *match;        /* GET: If-None-Match MD5, or NULL */
+    int           compress;     /* whether there was a Compress line */
+    int           prefetched;   /* GET: read into the cache ahead of time */
+    int           defer_sync;   /* COMMIT, LINK: the caller makes the names
+                                   durable (see struct response) */
+    long          offset;
+    long          length;       /* GET: bytes wanted, or -1 for the rest;
+                                   PUT: whole file size */
+};
+
+/*
+ * One file's worth of a response body.  It comes from memory when data is
+ * set (a cached file, held by entry), and otherwise from fd starting at
+ * offset, without passing through user space.  offset and length advance as
+ * the body is sent.
+ */
+struct body {
+    const char         *data;
+    struct cache_entry *entry;
+    int                 fd;
+    off_t               offset;
+    size_t              length;
+    int                 xfer;       /* XFER_* method for fd */
+};
+
+/* sendfile() when it can, else splice() through a pipe, with or without an
+   offset depending on whether fd can seek; or compressed frames made a
+   chunk at a time, from data or fd, in which case length counts the raw
+   bytes left plus FRAME_HDR for the closing frame */
+enum { XFER_SENDFILE, XFER_SPLICE, XFER_SPLICE_STREAM, XFER_DEFLATE };
+
+/*
+ * A response that is ready to be sent: a header, preceded on the wire by its
+ * 32-bit length, then the bodies in order.  length counts the body bytes not
+ * yet sent, so the response is complete when it reaches 0 and the length and
+ * header are out too.  The header and the list of bodies belong to the
+ * arena the response was built in; frame buffers come from the pool.
+ *
+ * A COMMIT or LINK whose request has defer_sync set leaves its ndirs
+ * directories open in dirs, for the caller to make durable before the
+ * response goes out.
+ */
+struct response {
+    const char *header;
+    uint32_t    headersize;
+    uint32_t    prefix;         /* headersize as sent */
+    size_t      headsent;       /* bytes of prefix and header sent */
+    struct body *bodies;
+    int         nbodies;
+    int         cur;            /* first body not completely sent */
+    size_t      length;
+    struct body single;         /* storage for the usual one-body case */
+    int         pipe[2];        /* splice() staging for XFER_SPLICE* */
+    size_t      piped;          /* body bytes sitting in pipe */
+    char       *zraw;           /* XFER_DEFLATE: a chunk read from fd */
+    char       *zbuf;           /* XFER_DEFLATE: the frame being sent */
+    size_t      zlen;
+    size_t      zoff;
+    size_t      zunits;         /* what the frame counts for in length */
+    int         dirs[2];        /* whose entries must be durable first */
+    int         ndirs;
+};
+
+/*
+ * A PUT body on its way to disk.  The body is written to a temporary file
+ * beside the target, which only replaces the target once every byte has
+ * arrived, so a client that hangs up mid-upload leaves the old file intact.
+ * Memory use is one pooled buffer (see arena.h) for a PUT_CHUNK, however
+ * large the file is, plus one for a frame of a compressed body.
+ *
+ * A caller that mustn't wait on the disk sets spill, which is then handed
+ * each full buffer to write out at offset, and a fresh buffer takes its
+ * place.  The caller reports each write's outcome with put_spilled(), and
+ * must see every one reported before put_commit().
+ *
+ * put_commit() also makes the upload as durable as durable_mode() asks
+ * before it returns.  A caller that mustn't wait for that either does it
+ * in steps instead: put_finish(), then the data of fd made durable, then
+ * put_install(), then the ndirs directories it opened, then put_close().
+ */
+struct put_sink {
+    int    fd;
+    char  *tmpname;
+    char  *buf;
+    size_t have;        /* bytes in buf not yet written */
+    off_t  offset;      /* where in the file they go */
+    int  (*spill)(void *owner, char *buf, size_t len, off_t offset);
+    void  *owner;       /* spill()'s */
+    int    failed;      /* whether a spilled write went wrong */
+    long   remaining;   /* body bytes still to be received; if compressed,
+                           1 until the closing frame arrives */
+    int    compressed;
+    char   frame[FRAME_HDR];    /* the header of the frame being received */
+    size_t fhave;
+    char  *zbuf;        /* and its payload */
+    size_t zlen;
+    size_t zhave;
+    size_t zraw;        /* raw bytes the frame expands to */
+    long   raw;         /* raw bytes still to be decoded */
+    int    spilled;     /* whether any of the body has been written out */
+    int    ranged;      /* writing one range of a staging file */
+    EVP_MD_CTX *md5;    /* of the body so far, unless ranged */
+    EVP_MD_CTX *sha256; /* likewise, for the content store */
+    char   digest[MD5_HEX_LEN + 1];    /* the body's MD5 once committed */
+    int    dirs[2];     /* whose entries put_install() changed */
+    int    ndirs;
+};
+
+/*
+ * A file being read into the cache ahead of the GET that wants it, by a
+ * caller that reads without blocking: prefetch_begin() sets up data for the
+ * caller to read size bytes into, counting them in have, and prefetch_end()
+ * caches them, so that prepare_response() then finds the file in memory.
+ */
+struct prefetch {
+    int           fd;
+    struct stat   st;
+    char         *data;
+    size_t        size;
+    size_t        have;
+    unsigned long gen;
+};
+
+/*
+ * request_init() - set up the file cache.  With max_entries of 0, every GET
+ *                  is served from disk.  With map, files are cached as
+ *                  mmap()s rather than copies, and every file counts, not
+ *                  just those within max_bytes; a mapping is checked
+ *                  against its file's inode and mtime on each use.
+ *                  policy says what the cache evicts.  Returns 0, or -1
+ *                  on failure.
+ */
+int request_init(size_t max_entries, size_t max_bytes, int map,
+                 enum cache_policy policy);
+
+/*
+ * request_cached() - call fn on every file in the cache, as cache_walk()
+ *                    does, if there is a cache
+ */
+void request_cached(void (*fn)(const struct cache_entry *e, void *arg),
+                    void *arg);
+
+/*
+ * request_warm() - bring the file open as fd into the cache under key, as
+ *                  a GET of it would, unless it is already there.  gen is
+ *                  the generation request_generation() gave before fd was
+ *                  opened.  If digest isn't NULL, a file known to have
+ *                  other contents is left out.  Returns 0 if the file is
+ *                  cached, else -1.
+ */
+int request_warm(const char *key, int fd, const char *digest,
+                 unsigned long gen);
+
+/*
+ * request_prefetch() - whether req is a GET of a file that the cache lacks
+ *                      but might hold, so that it is worth reading ahead.
+ *                      If so, the lookup is counted as a miss now.  Only
+ *                      the name is looked up: with a store, finding the
+ *                      blob means reading an xattr, so that GET is left
+ *                      to request_blocks().
+ */
+int request_prefetch(struct request *req);
+
+/*
+ * request_blocks() - whether preparing the response to req may wait on the
+ *                    disk: anything but a STATS, or a GET of a file that
+ *                    is cached in memory under its name rather than
+ *                    mapped.  A stored file, cached under its blob, is
+ *                    looked up off the loop.
+ */
+int request_blocks(const struct request *req);
+
+/*
+ * request_generation() - the cache generation to read the file cached
+ *                        under key with.  Take it before opening the
+ *                        file, so that an update that lands in between
+ *                        keeps what was read out of the cache.
+ */
+unsigned long request_generation(const char *key);
+
+/*
+ * prefetch_begin() - get ready to read the file open as fd, which pf takes
+ *                    over, having taken the generation gen before opening
+ *                    it.  Returns 0, or -1 (having closed fd) if the file
+ *                    can't be cached.
+ */
+int prefetch_begin(struct prefetch *pf, int fd, unsigned long gen);
+
+/*
+ * prefetch_end() - cache the file for req if all of it was read, and let
+ *                  go of everything else
+ */
+void prefetch_end(struct prefetch *pf, const struct request *req);
+
+/*
+ * parse_request() - parse a NUL-terminated header in place.  Returns NULL on
+ *                   success, or the error message to send to the client.
+ */
+const char *parse_request(char *header, struct request *req);
+
+/*
+ * prepare_get() - open the file named by a GET and build its response.
+ *                 Returns NULL on success, or the error message to send.
+ */
+const char *prepare_get(struct request *req, struct response *resp,
+                        struct arena *arena);
+
+/*
+ * prepare_mget() - open every file named by an MGET and build one response
+ *                  for them all.  Its header is "OK\n<count>\n" and then a
+ *                  line "<status> <size> <name>" per file, in request order,
+ *                  where status is OK, NOTFOUND or ERROR; the bodies of the
+ *                  OK files follow in the same order.
+ */
+const char *prepare_mget(struct request *req, struct response *resp,
+                         struct arena *arena);
+
+/*
+ * prepare_sum() - describe a file for a client about to fetch it in ranges.
+ *                 The header is "OK\n<name>\n<size>\n<md5>\n".
+ */
+const char *prepare_sum(struct request *req, struct response *resp,
+                        struct arena *arena);
+
+/*
+ * prepare_commit() - check that the staging file of a ranged PUT has the
+ *                    size and MD5 the client expects, and move it into
+ *                    place.  The response is the same as for a PUT.
+ */
+const char *prepare_commit(struct request *req, struct response *resp,
+                           struct arena *arena);
+
+/*
+ * prepare_link() - make a file hold content that the content store already
+ *                  has, named by its SHA-256, so that a client need not
+ *                  upload it again.  The response is the same as for a PUT,
+ *                  or, when there is no such content (or no store), a
+ *                  header of "MISSING\n" that leaves the connection open
+ *                  for the client to PUT the file after all.
+ */
+const char *prepare_link(struct request *req, struct response *resp,
+                         struct arena *arena);
+
+/*
+ * prepare_stats() - report the server's counters and latencies (see
+ *                   stats.h).  A STATS request is the single line "STATS",
+ *                   and the header is "OK\n" and then a line per figure.
+ */
+const char *prepare_stats(struct request *req, struct response *resp,
+                          struct arena *arena);
+
+/*
+ * prepare_response() - build the response to any request but a PUT, which
+ *                      has a body to read first, in arena.  Returns NULL on
+ *                      success, or the error message to send.
+ */
+const char *prepare_response(struct request *req, struct response *resp,
+                             struct arena *arena);
+
+/*
+ * send_body() - send as much of a response body as sockfd will take.
+ *               Returns the number of bytes sent, or -1 with errno set
+ *               (EAGAIN when a non-blocking socket is full).
+ */
+ssize_t send_body(int sockfd, struct response *resp);
+
+/*
+ * response_send() - send as much of a response as sockfd will take.  The
+ *                   length, the header, and a body that is in memory go
+ *                   out together in one sendmsg(); other bodies follow
+ *                   through send_body(), with the header held back by
+ *                   MSG_MORE to share their first packet.  Returns the
+ *                   number of bytes sent, or -1 with errno set.
+ */
+ssize_t response_send(int sockfd, struct response *resp);
+
+/*
+ * response_sent() - whether all of a response has gone out
+ */
+int response_sent(const struct response *resp);
+
+/*
+ * response_blocks() - whether sending what is next of a response may wait
+ *                     on the disk, since it comes from a file, or from a
+ *                     mapping of one
+ */
+int response_blocks(const struct response *resp);
+
+/*
+ * A connection's read-ahead buffer.  One recv() into it usually brings a
+ * request's length, its header, and the start of any body, so that small
+ * requests cost one system call rather than one per field.  Bytes beyond
+ * the current request wait here for the next one.  The buffer is taken
+ * from the pool only while it holds something, so an idle connection
+ * costs none.
+ */
+struct reader {
+    size_t start;           /* first byte not yet taken */
+    size_t end;
+    char  *buf;             /* NULL when empty */
+};
+
+/*
+ * reader_recv() - recv() through a reader: bytes already buffered first,
+ *                 then, for a small read, a buffer's worth from fd, and for
+ *                 a large one, straight into dst.  Returns like recv().
+ */
+ssize_t reader_recv(struct reader *r, int fd, void *dst, size_t len);
+
+/*
+ * reader_free() - throw away whatever a reader holds
+ */
+void reader_free(struct reader *r);
+
+/*
+ * put_begin() - create the temporary file for a PUT, or open the staging
+ *               file for a ranged one.  Returns NULL on success, or the
+ *               error message to send.
+ */
+const char *put_begin(struct request *req, struct put_sink *sink);
+
+/*
+ * put_space() - where the next body bytes should be received, and at most
+ *               how many
+ */
+char *put_space(struct put_sink *sink, size_t *len);
+
+/*
+ * put_received() - account for n bytes received into put_space().  Returns
+ *                  -1 if they could not be written out.
+ */
+int put_received(struct put_sink *sink, size_t n);
+
+/*
+ * put_drain() - once the whole body is in, start writing out the rest of
+ *               it.  Returns -1 if that fails.
+ */
+int put_drain(struct put_sink *sink);
+
+/*
+ * put_spilled() - report that a write handed to spill() is over, and
+ *                 whether it wrote everything
+ */
+void put_spilled(struct put_sink *sink, char *buf, int ok);
+
+/*
+ * put_commit() - once the whole body is in, and written out, move it into
+ *                place.  Returns NULL on success, or the error message to
+ *                send.
+ */
+const char *put_commit(struct request *req, struct put_sink *sink);
+
+/*
+ * put_finish() - the first step of put_commit(): write out and hash the
+ *                rest of the body.  Returns NULL on success, or the error
+ *                message to send.
+ */
+const char *put_finish(struct put_sink *sink);
+
+/*
+ * put_install() - the second step: move the upload into place, opening
+ *                 the directories whose entries that changed, unless
+ *                 nothing is to be made durable.  Returns NULL on success,
+ *                 or the error message to send.
+ */
+const char *put_install(struct request *req, struct put_sink *sink);
+
+/*
+ * put_close() - the last step: release what an installed upload holds
+ */
+void put_close(struct put_sink *sink);
+
+/*
+ * put_abort() - throw away a partial upload
+ */
+void put_abort(struct put_sink *sink);
+
+/*
+ * response_init() - an empty response that owns nothing
+ */
+void response_init(struct response *resp);
+
+/*
+ * response_ok() - the response that acknowledges a PUT, with the MD5 of
+ *                 what was stored if digest is not NULL, built in arena.
+ *                 Returns 0, or -1 on failure.
+ */
+int response_ok(struct response *resp, const char *digest,
+                struct arena *arena);
+
+/*
+ * response_error() - a response carrying only an error message, which it
+ *                    points to rather than copies; the messages these
+ *                    functions return are all constants
+ */
+void response_error(struct response *resp, const char *msg);
+
+/*
+ * request_error() - the kind of error that a message returned by these
+ *                   functions, or one of the messages above, reports
+ */
+enum req_error request_error(const char *msg);
+
+/*
+ * response_free() - release the files and buffers held by a response
+ */
+void response_free(struct response *resp);
+
+#endif
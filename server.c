@@ -3,7 +3,9 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/md5.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,6 +15,18 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "accesslog.h"
+#include "durable.h"
+#include "event.h"
+#include "manifest.h"
+#include "pool.h"
+#include "request.h"
+#include "stats.h"
+#include "store.h"
+#include "support.h"
+
+/* Microseconds to wait before accepting again when out of descriptors */
+#define ACCEPT_RETRY_US 100000
 
 /*
  * help() - Print a help message
@@ -20,8 +34,23 @@
 void help(char *progname) {
     printf("Usage: %s [OPTIONS]\n", progname);
     printf("Initiate a network file server\n");
-    printf("  -l    number of entries in cache\n");
+    printf("  -l    number of entries in cache (0 disables the cache)\n");
+    printf("  -b    bytes of file data in cache (K, M and G suffixes allowed)\n");
+    printf("  -m    cache files by mapping them, so that -b doesn't limit them\n");
+    printf("  -c    cache policy: clock (default), or tinylfu to resist scans\n");
+    printf("  -w    file listing what is cached, to warm the cache from on restart\n");
     printf("  -p    port on which to listen for connections\n");
+    printf("  -t    number of worker threads (0 serves one connection at a time)\n");
+    printf("  -q    number of accepted connections that may wait for a worker\n");
+    printf("  -e    serve from non-blocking event loops instead (0: one per core)\n");
+    printf("  -i    how event loops reach the disk: uring (default, or threads\n");
+    printf("        where io_uring is missing), threads, or none to block\n");
+    printf("  -k    keep connections open for more requests, until idle this many seconds\n");
+    printf("  -s    keep each distinct upload once, in this content store directory\n");
+    printf("  -d    make uploads durable before acknowledging them: none (default),\n");
+    printf("        sync for each on its own, or group to share flushes\n");
+    printf("  -a    append the access log to this file (default: standard output)\n");
+    printf("  -r    log client hostnames instead of addresses\n");
 }
 
 /*
@@ -34,9 +63,10 @@ void die(const char *msg1, char *msg2) {
 
 /*
  * open_server_socket() - Open a listening socket and return its file
- *                        descriptor, or terminate the program
+ *                        descriptor, or terminate the program.  With
+ *                        reuseport, several sockets may listen on one port.
  */
-int open_server_socket(int port) {
+int open_server_socket(int port, int reuseport) {
     int                listenfd;    /* the server's listening file descriptor */
     struct sockaddr_in addrs;       /* describes which clients we'll accept */
     int                optval = 1;  /* for configuring the socket */
@@ -49,6 +79,17 @@ int open_server_socket(int port) {
     if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
                    (const void *)&optval , sizeof(int)) < 0)
         die("Error configuring socket: ", strerror(errno));
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                (const void *)&optval , sizeof(int)) < 0)
+        die("Error configuring socket: ", strerror(errno));
+
+    /* Responses go out in whole writes already, with MSG_MORE holding a
+       header back for its body, so all Nagle's algorithm would do is hold
+       the tail of a body until the client's delayed ACK.  Accepted sockets
+       inherit this. */
+    if (setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY,
+                   (const void *)&optval , sizeof(int)) < 0)
+        die("Error configuring socket: ", strerror(errno));
 
     /* Listenfd will be an endpoint for all requests to the port from any IP
        address */
@@ -69,27 +110,36 @@ int open_server_socket(int port) {
 /*
  * handle_requests() - given a listening file descriptor, continually wait
  *                     for a request to come in, and when it arrives, pass it
- *                     to service_function.  Note that this is not a
- *                     multi-threaded server.
+ *                     to service_function.  If a worker pool is given, the
+ *                     connection is queued for one of its threads instead of
+ *                     being served inline.
  */
-void handle_requests(int listenfd, void (*service_function)(int, int), int param) {
+void handle_requests(int listenfd, void (*service_function)(int, int), int param,
+                     struct pool *pool) {
     while (1) {
-        /* block until we get a connection */
-        struct sockaddr_in clientaddr;
-        int clientlen = sizeof(clientaddr);
+        /* block until we get a connection; the access log says who it is
+           from, off this thread */
         int connfd;
-        if ((connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen)) < 0)
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0) {
+            /* a connection that went away, or a signal, loses nothing */
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+                continue;
+            /* running out of descriptors or memory passes, once some
+               connections close; the client waits in the backlog */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+                errno == ENOMEM) {
+                fprintf(stderr, "Error in accept(): %s\n", strerror(errno));
+                usleep(ACCEPT_RETRY_US);
+                continue;
+            }
             die("Error in accept(): ", strerror(errno));
+        }
 
-        /* print some info about the connection */
-        struct hostent *hp = gethostbyaddr((const char *)&clientaddr.sin_addr.s_addr,
-                           sizeof(clientaddr.sin_addr.s_addr), AF_INET);
-        if (hp == NULL) {
-            fprintf(stderr, "DNS error in gethostbyaddr() %d\n", h_errno);
-            exit(0);
+        /* let a worker serve it; this blocks while the queue is full */
+        if (pool) {
+            pool_submit(pool, connfd);
+            continue;
         }
-        char *haddrp = inet_ntoa(clientaddr.sin_addr);
-        printf("server connected to %s (%s)\n", hp->h_name, haddrp);
 
         /* serve requests */
         service_function(connfd, param);
@@ -101,20 +151,22 @@ void handle_requests(int listenfd, void (*service_function)(int, int), int param
 }
 
 /*
- * - Receive() - recv wrapper
+ * - Receive() - recv wrapper, reading through the connection's read-ahead
+ *               buffer.  Returns nonzero if the client hung up or the
+ *               connection failed before length bytes arrived.
  */
-unsigned char Receive(int connfd, void * buffer, int length){
+unsigned char Receive(struct reader *rd, int connfd, void * buffer, int length){
     unsigned char * buf_location = (unsigned char * )buffer;
     unsigned char return_value = 0;
     int bytes_received = 1;
     while(length && !return_value){
-        bytes_received = recv(connfd, buffer, length, 0);
+        bytes_received = reader_recv(rd, connfd, buf_location, length);
         if(!bytes_received){
             return_value = 1;
         }
         else if(bytes_received == -1){
             if(errno != EINTR)
-                die("read error: ", strerror(errno));
+                return_value = 1;
             continue;
         }
         else{
@@ -124,150 +176,175 @@ unsigned char Receive(int connfd, void * buffer, int length){
     }
     return return_value;
 }
+
 /*
- * - Receive_Int() - uses Receive() to grab one int
- */
-uint32_t Receive_Int(int connfd){
-    uint32_t return_value;
-    Receive(connfd, &return_value, sizeof(return_value));
-    return return_value;
-    //return ntohl(return_value);
-}
-/*
- * - Send() - write wrapper
+ * send_response() - send a prepared response; file bodies go from the page
+ *                   cache to the socket without being copied through us.
+ *                   Gives up quietly if the client has gone away; the
+ *                   caller will find out on its next Receive().
  */
-void Send(int connfd, void * buffer, int length)
+void send_response(int connfd, struct response *resp)
 {
-    unsigned char * buf_location = (unsigned char * )buffer;
-    int bytes_sent = 1;
-    while(length){
-        if ((bytes_sent = write(connfd, buf_location, length)) < 0)
-        {
-            if (errno != EINTR)
-                die("Put_file write error", strerror(errno));
-            bytes_sent = 0;
+    while (!response_sent(resp)) {
+        if (response_send(connfd, resp) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
         }
-        length -= bytes_sent;
-        buf_location += bytes_sent;
     }
 }
-/*
- * - Send_Int() - uses Send() to send one int
- */
-void Send_Int(int connfd, uint32_t val){
-    Send(connfd, &val, sizeof(val));
-    //return return_value;
-    //return ntohl(return_value);
-}
 
 /*
  * send_error() - send an error back to the client
  */
-void send_error(int connfd, char * msg)
+void send_error(int connfd, const char * msg)
 {
     fprintf(stderr, "Sending error message to client: %s", msg);
-    Send_Int(connfd, strlen(msg));
-    Send(connfd, msg, strlen(msg));
+    stats_error(request_error(msg));
+    struct response resp;
+    response_error(&resp, msg);
+    send_response(connfd, &resp);
+    response_free(&resp);
 }
 
 /*
- * - file_server() - etc
+ * - satisfy_request() - act on a parsed request, and say in bytes how much
+ *                       body it moved.  Returns 0 if it succeeded and the
+ *                       connection is ready for another request, or -1 if
+ *                       it should be closed.
  */
-void file_server(int connfd, int lru_size){
-    /* static vars for managing LRU cache */
+int satisfy_request(struct reader *rd, struct arena *arena, int connfd,
+                    struct request *req, size_t *bytes){
+    const char * err;
+    /* handle PUT */
+    if(req->type == REQ_PUT){
+        /* stream the body to disk a chunk at a time */
+        struct put_sink sink;
+        if((err = put_begin(req, &sink)) != NULL){
+            send_error(connfd, err);
+            return -1;
+        }
+        while(sink.remaining){
+            size_t len;
+            char * space = put_space(&sink, &len);
+            if(Receive(rd, connfd, space, len) != 0){
+                fprintf(stderr, "Connection closed while reading file for PUT\n");
+                put_abort(&sink);
+                return -1;
+            }
+            if(put_received(&sink, len) < 0){
+                put_abort(&sink);
+                send_error(connfd, PUT_UNWRITABLE);
+                return -1;
+            }
+        }
+        *bytes = req->filesize;
+        if((err = put_commit(req, &sink)) != NULL){
+            send_error(connfd, err);
+            return -1;
+        }
+        /* tell the client the PUT was successful */
+        struct response resp;
+        if(response_ok(&resp, req->want_digest && sink.digest[0]
+                                  ? sink.digest : NULL, arena) < 0){
+            return -1;
+        }
+        send_response(connfd, &resp);
+        response_free(&resp);
+        return 0;
+    }
+    /* handle everything else */
+    struct response resp;
+    if((err = prepare_response(req, &resp, arena)) != NULL){
+        send_error(connfd, err);
+        return -1;
+    }
+    *bytes = resp.length;
+    send_response(connfd, &resp);
+    int complete = (resp.length == 0);
+    response_free(&resp);
+    return complete ? 0 : -1;
+}
 
-    /* read the header size from the client */
+/*
+ * - serve_request() - read one request from the client at peer, satisfy
+ *                     it, and log it, allocating from arena.  Returns 0 if
+ *                     the connection is ready for another request, or -1
+ *                     if it should be closed.
+ */
+int serve_request(struct reader *rd, struct arena *arena, int connfd,
+                  const struct sockaddr_in *peer){
+    /* read the header size from the client; EOF here is a normal hang-up */
     uint32_t headersize;
-    headersize = Receive_Int(connfd);
-    /* read the header from the client */
-    char header[headersize];
-    if(Receive(connfd, header, headersize) != 0){
-        die("SERVER FILE_SERVER", "Connection closed while reading header");
+    if(Receive(rd, connfd, &headersize, sizeof(headersize)) != 0){
+        return -1;
     }
+    if(headersize == 0 || headersize > REQ_MAX_HEADER){
+        send_error(connfd, HEADER_TOO_LARGE);
+        accesslog_request(peer, NULL, 0, 0, 0);
+        return -1;
+    }
+    /* read the header from the client, and terminate it for parsing */
+    char * header = arena_alloc(arena, headersize + 1);
+    if(header == NULL){
+        return -1;
+    }
+    if(Receive(rd, connfd, header, headersize) != 0){
+        fprintf(stderr, "Connection closed while reading header\n");
+        return -1;
+    }
+    header[headersize] = '\0';
+    uint64_t start = stats_now();
     /* parse the header */
-    char * request_type = strtok(header, "\n");
-    int is_put = (strcmp(request_type, "PUT") == 0);
-    int is_get = (strcmp(request_type, "GET") == 0);
-    if(!is_put && !is_get){
-        send_error(connfd, "Request must begin with PUT or GET\n");
-        return;
+    struct request req;
+    const char * err;
+    if((err = parse_request(header, &req)) != NULL){
+        send_error(connfd, err);
+        accesslog_request(peer, NULL, 0, 0, stats_now() - start);
+        return -1;
     }
-    char * filename;
-    if((filename = strtok(NULL, "\n")) == NULL){
-        send_error(connfd, "Request must include filename\n");
-        return;
+    size_t bytes = 0;
+    int rc = satisfy_request(rd, arena, connfd, &req, &bytes);
+    uint64_t ns = stats_now() - start;
+    if(rc == 0){
+        stats_request(req.type, ns);
     }
-    /* handle PUT */
-    if(is_put){
-        char * filesize_str;
-        if((filesize_str = strtok(NULL, "\n")) == NULL){
-            send_error(connfd, "PUT request must include filesize\n");
-            return;
-        }
-        char * t;
-        long filesize = strtol(filesize_str, &t, 10);
-        if(filesize_str == t){
-            send_error(connfd, "Invalid filesize in PUT request\n");
-            return;
-        }
-        char file[filesize];
-        if(Receive(connfd, file, filesize) != 0){
-            die("SERVER PUT","Connection closed while reading file for PUT");
-        }
-        /* save the file buffer to the server */
-        FILE * fp = fopen(filename, "wb");
-        fwrite(file, sizeof(file), 1, fp);
-        fclose(fp);
-        /* tell the client the PUT was successful */
-        char response[] = "OK\n";
-        Send_Int(connfd, sizeof(response));
-        Send(connfd, response, sizeof(response));
+    accesslog_request(peer, &req, rc == 0, bytes, ns);
+    return rc;
+}
+
+/*
+ * - file_server() - serve a connection: a single request, or with keepalive,
+ *                   requests until the client hangs up or sits idle for
+ *                   keepalive seconds
+ */
+void file_server(int connfd, int keepalive){
+    /* the client's address, for the access log */
+    struct sockaddr_in peer = { 0 };
+    socklen_t peerlen = sizeof(peer);
+    getpeername(connfd, (struct sockaddr *)&peer, &peerlen);
+
+    /* a request's length and header, and any pipelined behind it, usually
+       arrive in one read; what the request needs after that comes from an
+       arena that is emptied between requests */
+    struct reader rd = { 0 };
+    struct arena arena = { 0 };
+
+    stats_connection(1);
+    if(!keepalive){
+        serve_request(&rd, &arena, connfd, &peer);
     }
-    /* handle GET */
     else{
-        FILE * fp = fopen(filename, "rb");
-        if(fp == NULL){
-            send_error(connfd, "GET file not found\n");
-            return;
-        }
-        fseek(fp, 0, SEEK_END);
-        size_t filesize = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        unsigned char file[filesize];
-        size_t bytes_read = fread(file, sizeof(unsigned char), filesize, fp);
-        if(bytes_read != filesize){
-            fclose(fp);
-            send_error(connfd, "GET file could not be read\n");
-            return;
-        }
-        fclose(fp);
-        
-        /* convert filesize to string */
-        int j = 1, temp_size = filesize / 10;
-        while (temp_size)
-        {
-            j++;
-            temp_size /= 10;
-        }
-        char size[j];
-        sprintf(size, "%d", filesize); 
-
-        uint32_t response_headersize = strlen("OK\n") + strlen(filename) + j + 2;  
-        char response_header[response_headersize];
-        bzero(response_header, response_headersize);
-        strcpy(response_header, "OK\n");
-        strcat(response_header, filename);
-        strcat(response_header, "\n");
-        strcat(response_header, size);
-        strcat(response_header, "\n");
-
-        /* send the header size */
-        Send_Int(connfd, response_headersize);
-        /* send the header */
-        Send(connfd, response_header, response_headersize);
-        /* send the file */
-        Send(connfd, file, filesize);
+        /* a client that stalls, between requests or within one, times out */
+        struct timeval tv = { .tv_sec = keepalive };
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        while(serve_request(&rd, &arena, connfd, &peer) == 0)
+            arena_reset(&arena);
     }
+    arena_reset(&arena);
+    reader_free(&rd);
+    stats_connection(-1);
 }
 /*
  * file_server() - Read a request from a socket, satisfy the request, and
@@ -433,6 +510,20 @@ void file_server(int connfd, int lru_size){
 //     // }
 // }
 
+/*
+ * parse_size() - parse a byte count with an optional K, M or G suffix
+ */
+size_t parse_size(const char *str) {
+    char *t;
+    size_t size = strtoull(str, &t, 10);
+    switch (*t) {
+      case 'G': case 'g': size <<= 10; /* fall through */
+      case 'M': case 'm': size <<= 10; /* fall through */
+      case 'K': case 'k': size <<= 10;
+    }
+    return size;
+}
+
 /*
  * main() - parse command line, create a socket, handle requests
  */
@@ -440,23 +531,108 @@ int main(int argc, char **argv) {
     /* for getopt */
     long opt;
     int  lru_size = 10;
+    size_t lru_bytes = 64 << 20;
     int  port     = 9000;
+    int  nthreads = 0;
+    int  qsize    = 0;
+    int  nloops   = -1;
+    int  disk     = AIO_URING;
+    int  keepalive = 0;
+    char *store   = NULL;
+    char *logfile = "-";
+    int  resolve  = 0;
+    int  map      = 0;
+    int  policy   = CACHE_CLOCK;
+    char *warm    = NULL;
+    int  durability = DURABLE_NONE;
 
     check_team(argv[0]);
 
     /* parse the command-line options.  They are 'p' for port number,  */
-    /* and 'l' for lru cache size.  'h' is also supported. */
-    while ((opt = getopt(argc, argv, "hl:p:")) != -1) {
+    /* 'l' and 'b' for lru cache size in entries and bytes, 'm' to map */
+    /* files into the cache rather than copy them, 'c' for the cache's */
+    /* policy, 'w' for its manifest, 't' for worker threads, 'q' for   */
+    /* the worker queue length, 'e' for event loops and 'i' for how    */
+    /* they reach the disk, 'k' for the keep-alive idle timeout, 's'   */
+    /* for the content store, 'd' for how durable uploads are, and 'a' */
+    /* and 'r' for the access log and whether it names clients by      */
+    /* hostname.  'h' is also supported. */
+    while ((opt = getopt(argc, argv, "hl:b:mc:w:p:t:q:e:i:k:s:d:a:r")) != -1) {
         switch(opt) {
           case 'h': help(argv[0]); break;
-          case 'l': lru_size = atoi(argv[0]); break;
+          case 'l': lru_size = atoi(optarg); break;
+          case 'b': lru_bytes = parse_size(optarg); break;
+          case 'm': map = 1; break;
+          case 'c': policy = cache_policy_parse(optarg); break;
+          case 'w': warm = optarg; break;
           case 'p': port = atoi(optarg); break;
+          case 't': nthreads = atoi(optarg); break;
+          case 'q': qsize = atoi(optarg); break;
+          case 'e': nloops = atoi(optarg); break;
+          case 'i': disk = aio_engine_parse(optarg); break;
+          case 'k': keepalive = atoi(optarg); break;
+          case 's': store = optarg; break;
+          case 'd': durability = durable_parse(optarg); break;
+          case 'a': logfile = optarg; break;
+          case 'r': resolve = 1; break;
         }
     }
 
+    if (store && store_open(store) < 0)
+        die("Error opening content store", strerror(errno));
+
+    if (policy < 0)
+        die("Usage error", "unknown cache policy");
+    if (disk < 0)
+        die("Usage error", "unknown disk engine");
+    if (durability < 0)
+        die("Usage error", "unknown durability");
+    if (lru_size < 0 || request_init(lru_size, lru_bytes, map, policy) < 0)
+        die("Error creating cache", "out of memory");
+
+    /* a client hanging up must not take the server down with SIGPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* warm the cache in the background, and keep a record of it for next
+       time, saved last on SIGINT or SIGTERM */
+    if (warm && lru_size == 0)
+        die("Usage error", "-w needs a cache");
+    if (warm && manifest_open(warm) < 0)
+        die("Error opening cache manifest", strerror(errno));
+
+    /* kill -USR1 prints the counters; this must precede other threads */
+    if (stats_init(SIGUSR1) < 0)
+        die("Error starting statistics", "out of resources");
+    if (accesslog_open(logfile, resolve) < 0)
+        die("Error opening access log", strerror(errno));
+    if (durable_init(durability) < 0)
+        die("Error starting group commit", strerror(errno));
+
+    /* event loops each get their own socket on the shared port */
+    if (nloops >= 0) {
+        if (nloops == 0)
+            nloops = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nloops < 1)
+            nloops = 1;
+        int fds[nloops];
+        for (int i = 0; i < nloops; i++)
+            fds[i] = open_server_socket(port, 1);
+        event_serve(fds, nloops, keepalive, disk);
+    }
+
+    /* start the workers; by default let each one have a couple of
+       connections waiting for it */
+    struct pool *pool = NULL;
+    if (nthreads > 0) {
+        if (qsize <= 0)
+            qsize = 2 * nthreads;
+        if ((pool = pool_create(nthreads, qsize, file_server, keepalive)) == NULL)
+            die("Error creating worker pool", "out of resources");
+    }
+
     /* open a socket, and start handling requests */
-    int fd = open_server_socket(port);
-    handle_requests(fd, file_server, lru_size);
+    int fd = open_server_socket(port, 0);
+    handle_requests(fd, file_server, keepalive, pool);
 
     exit(0);
 }
@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include "sketch.h"
+
+/* Odd multipliers that give each row its own scattering of the hash */
+static const uint64_t seeds[SKETCH_ROWS] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+    0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+};
+
+/*
+ * slot() - the counter for a hash in one row
+ */
+static uint8_t *slot(struct sketch *sk, uint64_t hash, int row) {
+    return &sk->counts[row * sk->width + ((hash * seeds[row]) >> sk->shift)];
+}
+
+int sketch_init(struct sketch *sk, size_t capacity) {
+    sk->width = 64;
+    sk->shift = 64 - 6;
+    while (sk->width < 2 * capacity) {
+        sk->width *= 2;
+        sk->shift--;
+    }
+    sk->samples = 0;
+    sk->period = 10 * (capacity ? capacity : 1);
+    sk->counts = calloc(SKETCH_ROWS, sk->width);
+    return sk->counts ? 0 : -1;
+}
+
+void sketch_free(struct sketch *sk) {
+    free(sk->counts);
+    sk->counts = NULL;
+}
+
+/*
+ * halve() - age every counter
+ */
+static void halve(struct sketch *sk) {
+    for (size_t i = 0; i < SKETCH_ROWS * sk->width; i++)
+        __atomic_store_n(&sk->counts[i],
+                         __atomic_load_n(&sk->counts[i], __ATOMIC_RELAXED) >> 1,
+                         __ATOMIC_RELAXED);
+}
+
+void sketch_add(struct sketch *sk, uint64_t hash) {
+    /* only the counters at the key's current count grow, which keeps keys
+       that share some counters with a popular one from being overrated */
+    unsigned min = sketch_count(sk, hash);
+    for (int row = 0; row < SKETCH_ROWS && min < SKETCH_MAX; row++) {
+        uint8_t want = min;
+        __atomic_compare_exchange_n(slot(sk, hash, row), &want, min + 1, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&sk->samples, 1, __ATOMIC_RELAXED) == sk->period) {
+        __atomic_store_n(&sk->samples, 0, __ATOMIC_RELAXED);
+        halve(sk);
+    }
+}
+
+unsigned sketch_count(struct sketch *sk, uint64_t hash) {
+    unsigned min = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        unsigned n = __atomic_load_n(slot(sk, hash, row), __ATOMIC_RELAXED);
+        if (n < min)
+            min = n;
+    }
+    return min;
+}
@@ -0,0 +1,52 @@
+#ifndef SKETCH_H__
+#define SKETCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A count-min sketch: roughly how often each key has been seen lately, in a
+ * few bytes per key of capacity, for the cache's admission policy.  A key
+ * bumps one small counter in each of SKETCH_ROWS rows, and its count is the
+ * least of them, which errs only high, and only when other keys share all
+ * of its counters.  Counters stop at SKETCH_MAX, and once the sketch has
+ * counted ten times its capacity, every counter is halved, so that what was
+ * popular a while ago fades.
+ *
+ * Any thread may add to or read a sketch at any time without a lock.  The
+ * counts are estimates anyway, so a race costs at most a lost increment.
+ */
+
+#define SKETCH_ROWS 4
+#define SKETCH_MAX  15
+
+struct sketch {
+    uint8_t *counts;        /* SKETCH_ROWS rows of width counters */
+    size_t   width;         /* a power of two */
+    int      shift;         /* 64 - log2(width) */
+    size_t   samples;       /* additions since the last halving */
+    size_t   period;        /* additions between halvings */
+};
+
+/*
+ * sketch_init() - make an empty sketch for about capacity keys.  Returns 0,
+ *                 or -1 if out of memory.
+ */
+int sketch_init(struct sketch *sk, size_t capacity);
+
+/*
+ * sketch_free() - release a sketch's counters
+ */
+void sketch_free(struct sketch *sk);
+
+/*
+ * sketch_add() - count one sighting of the key with this hash
+ */
+void sketch_add(struct sketch *sk, uint64_t hash);
+
+/*
+ * sketch_count() - about how often the key with this hash has been seen
+ */
+unsigned sketch_count(struct sketch *sk, uint64_t hash);
+
+#endif
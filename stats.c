@@ -0,0 +1,252 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stats.h"
+
+/*
+ * Histogram buckets: values below HIST_SUB microseconds get a bucket each,
+ * and every power of two above that is split into HIST_SUB equal buckets.
+ * Values are clamped at 2^HIST_MAX_LOG microseconds (about 12 days).
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_LOG  40
+#define HIST_BUCKETS  ((HIST_MAX_LOG - HIST_SUB_BITS + 2) * HIST_SUB)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;               /* microseconds */
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/* Names of the request types and error kinds, as reported */
+static const char *type_names[REQ_NTYPES] = {
+    "get", "put", "mget", "sum", "commit", "link", "stats"
+};
+static const char *error_names[ERR_NTYPES] = {
+    "bad_request", "not_found", "range", "digest", "io", "other"
+};
+
+static struct {
+    uint64_t         started;
+    uint64_t         bytes_in;
+    uint64_t         bytes_out;
+    uint64_t         cache_hits;
+    uint64_t         cache_misses;
+    uint64_t         cache_evictions;
+    uint64_t         cache_rejections;
+    const char      *cache_policy;
+    uint64_t         groups;
+    uint64_t         group_members;
+    const char      *durability;
+    int64_t          connections;
+    uint64_t         connections_total;
+    int64_t          queued;
+    uint64_t         errors[ERR_NTYPES];
+    struct histogram latency[REQ_NTYPES];
+} stats;
+
+/*
+ * add() - bump a counter from any thread
+ */
+static void add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * bucket() - the histogram bucket for a value in microseconds
+ */
+static int bucket(uint64_t us) {
+    if (us < HIST_SUB)
+        return us;
+    if (us >= 1ULL << HIST_MAX_LOG)
+        us = (1ULL << HIST_MAX_LOG) - 1;
+    int log = 63 - __builtin_clzll(us);
+    return (log - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((us >> (log - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * bucket_top() - the largest value that falls in a bucket
+ */
+static uint64_t bucket_top(int i) {
+    if (i < HIST_SUB)
+        return i;
+    int shift = i / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+void stats_request(enum req_type type, uint64_t ns) {
+    struct histogram *h = &stats.latency[type];
+    uint64_t us = ns / 1000;
+    add(&h->count, 1);
+    add(&h->sum, us);
+    add(&h->buckets[bucket(us)], 1);
+    uint64_t max = get(&h->max);
+    while (us > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, us, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void stats_error(enum req_error kind) {
+    add(&stats.errors[kind], 1);
+}
+
+void stats_bytes_in(size_t n) {
+    add(&stats.bytes_in, n);
+}
+
+void stats_bytes_out(size_t n) {
+    add(&stats.bytes_out, n);
+}
+
+void stats_cache(int hit) {
+    add(hit ? &stats.cache_hits : &stats.cache_misses, 1);
+}
+
+void stats_eviction(int rejected) {
+    add(rejected ? &stats.cache_rejections : &stats.cache_evictions, 1);
+}
+
+void stats_cache_policy(const char *name) {
+    stats.cache_policy = name;
+}
+
+void stats_group(size_t members) {
+    add(&stats.groups, 1);
+    add(&stats.group_members, members);
+}
+
+void stats_durability(const char *name) {
+    stats.durability = name;
+}
+
+void stats_connection(int delta) {
+    __atomic_fetch_add(&stats.connections, delta, __ATOMIC_RELAXED);
+    if (delta > 0)
+        add(&stats.connections_total, delta);
+}
+
+void stats_queued(int delta) {
+    __atomic_fetch_add(&stats.queued, delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * percentile() - the value that pct percent of a histogram's entries are
+ *                at or below, to within a bucket
+ */
+static uint64_t percentile(const struct histogram *h, uint64_t count,
+                           double pct) {
+    uint64_t want = (uint64_t)(count * pct / 100 + 0.5), seen = 0;
+    if (want == 0)
+        want = 1;
+    uint64_t max = get(&h->max);
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        if ((seen += get(&h->buckets[i])) >= want)
+            return bucket_top(i) < max ? bucket_top(i) : max;
+    return max;
+}
+
+char *stats_format(void) {
+    char *text;
+    size_t len;
+    FILE *fp = open_memstream(&text, &len);
+    if (fp == NULL)
+        return NULL;
+
+    fprintf(fp, "uptime_s %.3f\n", (stats_now() - stats.started) / 1e9);
+    fprintf(fp, "connections_active %ld\n",
+            (long)__atomic_load_n(&stats.connections, __ATOMIC_RELAXED));
+    fprintf(fp, "connections_total %lu\n",
+            (unsigned long)get(&stats.connections_total));
+    fprintf(fp, "queue_depth %ld\n",
+            (long)__atomic_load_n(&stats.queued, __ATOMIC_RELAXED));
+    fprintf(fp, "bytes_in %lu\n", (unsigned long)get(&stats.bytes_in));
+    fprintf(fp, "bytes_out %lu\n", (unsigned long)get(&stats.bytes_out));
+    fprintf(fp, "cache_hits %lu\n", (unsigned long)get(&stats.cache_hits));
+    fprintf(fp, "cache_misses %lu\n",
+            (unsigned long)get(&stats.cache_misses));
+    fprintf(fp, "cache_evictions %lu\n",
+            (unsigned long)get(&stats.cache_evictions));
+    fprintf(fp, "cache_rejections %lu\n",
+            (unsigned long)get(&stats.cache_rejections));
+    if (stats.cache_policy)
+        fprintf(fp, "cache_policy %s\n", stats.cache_policy);
+    if (stats.durability)
+        fprintf(fp, "durability %s\n", stats.durability);
+    fprintf(fp, "durable_groups %lu\n", (unsigned long)get(&stats.groups));
+    fprintf(fp, "durable_group_members %lu\n",
+            (unsigned long)get(&stats.group_members));
+    for (int i = 0; i < ERR_NTYPES; i++)
+        fprintf(fp, "errors_%s %lu\n", error_names[i],
+                (unsigned long)get(&stats.errors[i]));
+
+    /* latencies are in microseconds */
+    double pcts[] = { 50, 90, 99, 99.9 };
+    const char *pct_names[] = { "p50", "p90", "p99", "p999" };
+    for (int t = 0; t < REQ_NTYPES; t++) {
+        const struct histogram *h = &stats.latency[t];
+        uint64_t count = get(&h->count);
+        fprintf(fp, "%s_count %lu\n", type_names[t], (unsigned long)count);
+        if (count == 0)
+            continue;
+        fprintf(fp, "%s_mean_us %lu\n", type_names[t],
+                (unsigned long)(get(&h->sum) / count));
+        for (int p = 0; p < 4; p++)
+            fprintf(fp, "%s_%s_us %lu\n", type_names[t], pct_names[p],
+                    (unsigned long)percentile(h, count, pcts[p]));
+        fprintf(fp, "%s_max_us %lu\n", type_names[t],
+                (unsigned long)get(&h->max));
+    }
+    if (fclose(fp) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+/*
+ * dumper() - print the figures each time the signal comes in
+ */
+static void *dumper(void *arg) {
+    sigset_t *set = arg;
+    while (1) {
+        int signo;
+        if (sigwait(set, &signo) != 0)
+            continue;
+        char *text = stats_format();
+        if (text) {
+            fputs(text, stderr);
+            free(text);
+        }
+    }
+    return NULL;
+}
+
+int stats_init(int signo) {
+    static sigset_t set;
+    stats.started = stats_now();
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        return -1;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, dumper, &set) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
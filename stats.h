@@ -0,0 +1,95 @@
+#ifndef STATS_H__
+#define STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "request.h"
+
+/*
+ * Live counters for the server, updated with atomic adds so that any
+ * thread can record what it did without taking a lock.  Request latencies
+ * go into a histogram per request type whose buckets are spaced evenly
+ * within each power of two (as in HdrHistogram), which keeps any
+ * percentile read from it within about 6% of the truth, over microseconds
+ * to hours, in a fixed few kilobytes.
+ *
+ * The figures are read all at once by stats_format(), which a STATS request
+ * returns, and which the server writes to stderr on SIGUSR1.  Reads are not
+ * a snapshot: each figure is exact, but they may be from slightly different
+ * moments.
+ */
+
+/*
+ * stats_now() - a monotonic clock, in nanoseconds, for timing requests
+ */
+uint64_t stats_now(void);
+
+/*
+ * stats_request() - count a request that succeeded, and the time from its
+ *                   header arriving to its response going out
+ */
+void stats_request(enum req_type type, uint64_t ns);
+
+/*
+ * stats_error() - count an error response of this kind
+ */
+void stats_error(enum req_error kind);
+
+/*
+ * stats_bytes_in() / stats_bytes_out() - count body bytes received from
+ *                                        and sent to clients
+ */
+void stats_bytes_in(size_t n);
+void stats_bytes_out(size_t n);
+
+/*
+ * stats_cache() - count a cache lookup on behalf of a client, and whether
+ *                 it hit
+ */
+void stats_cache(int hit);
+
+/*
+ * stats_eviction() - count a file leaving the cache to make room, or with
+ *                    rejected, one that the cache's policy turned away
+ */
+void stats_eviction(int rejected);
+
+/*
+ * stats_cache_policy() - name the cache's policy in the figures
+ */
+void stats_cache_policy(const char *name);
+
+/*
+ * stats_group() - count a group commit, and the uploads it made durable
+ */
+void stats_group(size_t members);
+
+/*
+ * stats_durability() - name the durability mode in the figures
+ */
+void stats_durability(const char *name);
+
+/*
+ * stats_connection() / stats_queued() - note a connection starting (+1) or
+ *                                       finishing (-1) service, or joining
+ *                                       or leaving the workers' queue
+ */
+void stats_connection(int delta);
+void stats_queued(int delta);
+
+/*
+ * stats_format() - every figure, one per line as "<name> <value>", in a
+ *                  malloc()ed string.  Returns NULL if out of memory.
+ */
+char *stats_format(void);
+
+/*
+ * stats_init() - start the clock for uptime, and write stats_format() to
+ *                stderr whenever signal signo arrives.  Call it before
+ *                starting any other thread, so that they all leave the
+ *                signal to the one this starts.  Returns 0, or -1 on
+ *                failure.
+ */
+int stats_init(int signo);
+
+#endif
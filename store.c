@@ -0,0 +1,153 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include "digest.h"
+#include "store.h"
+
+/* The extended attribute holding a stored file's SHA-256 */
+#define STORE_XATTR "user.sha256"
+
+/* "<dir>/objects", or NULL when there is no store */
+static char *objects;
+
+int store_open(const char *dir) {
+    if (asprintf(&objects, "%s/objects", dir) < 0) {
+        objects = NULL;
+        return -1;
+    }
+    if ((mkdir(dir, 0777) < 0 && errno != EEXIST) ||
+        (mkdir(objects, 0777) < 0 && errno != EEXIST)) {
+        free(objects);
+        objects = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int store_enabled(void) {
+    return objects != NULL;
+}
+
+/*
+ * valid_hex() - whether a client-supplied hash is safe to use in a path
+ */
+static int valid_hex(const char *hex) {
+    return strlen(hex) == SHA256_HEX_LEN &&
+           strspn(hex, "0123456789abcdef") == SHA256_HEX_LEN;
+}
+
+void store_path(const char *hex, char *blob) {
+    snprintf(blob, PATH_MAX, "%s/%s", objects, hex);
+}
+
+/*
+ * lookup() - turn what getxattr() found into a blob path
+ */
+static int lookup(ssize_t n, char *hex, char *blob) {
+    if (n != SHA256_HEX_LEN)
+        return -1;
+    hex[n] = '\0';
+    if (!valid_hex(hex))
+        return -1;
+    store_path(hex, blob);
+    return 0;
+}
+
+int store_lookup(const char *filename, char *blob) {
+    char hex[SHA256_HEX_LEN + 1];
+    if (objects == NULL)
+        return -1;
+    return lookup(getxattr(filename, STORE_XATTR, hex, SHA256_HEX_LEN), hex,
+                  blob);
+}
+
+int store_lookup_fd(int fd, char *blob) {
+    char hex[SHA256_HEX_LEN + 1];
+    if (objects == NULL)
+        return -1;
+    return lookup(fgetxattr(fd, STORE_XATTR, hex, SHA256_HEX_LEN), hex, blob);
+}
+
+/*
+ * replace() - rename src over filename, and drop the blob of the content
+ *             filename held before, if nothing else links to it now
+ */
+static int replace(const char *src, const char *filename) {
+    char old[PATH_MAX];
+    int had = store_lookup(filename, old) == 0;
+    if (rename(src, filename) < 0)
+        return -1;
+    /* rename() leaves src alone if both names already link to the blob */
+    unlink(src);
+    struct stat st;
+    if (had && stat(old, &st) == 0 && st.st_nlink == 1)
+        unlink(old);
+    return 0;
+}
+
+/*
+ * take_stored() - make tmpname a link to the blob that already holds its
+ *                 content, in place of the new copy.  Another upload's
+ *                 replace() may drop the blob at any moment, so the new
+ *                 copy only goes once the blob is linked under a spare name,
+ *                 and if the blob went first, the new copy becomes it.
+ */
+static int take_stored(const char *tmpname, const char *blob) {
+    char spare[PATH_MAX];
+    if (snprintf(spare, sizeof(spare), "%s.link", tmpname) >=
+        (int)sizeof(spare)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    while (link(blob, spare) < 0) {
+        /* left behind by a crash */
+        if (errno == EEXIST && unlink(spare) == 0)
+            continue;
+        if (errno != ENOENT)
+            return -1;
+        if (link(tmpname, blob) == 0)
+            return 0;
+        if (errno != EEXIST)
+            return -1;
+    }
+    if (rename(spare, tmpname) < 0) {
+        unlink(spare);
+        return -1;
+    }
+    /* the blob may have been dropped since; if so, ours becomes it */
+    link(tmpname, blob);
+    return 0;
+}
+
+int store_commit(const char *tmpname, const char *filename, const char *hex) {
+    char blob[PATH_MAX];
+    store_path(hex, blob);
+    if (setxattr(tmpname, STORE_XATTR, hex, SHA256_HEX_LEN, 0) < 0)
+        return -1;
+    /* seen before: take the stored copy, and free the new one */
+    if (link(tmpname, blob) < 0 &&
+        (errno != EEXIST || take_stored(tmpname, blob) < 0))
+        return -1;
+    return replace(tmpname, filename);
+}
+
+int store_link(const char *tmpname, const char *filename, const char *hex) {
+    char blob[PATH_MAX];
+    if (objects == NULL || !valid_hex(hex)) {
+        errno = ENOENT;
+        return -1;
+    }
+    store_path(hex, blob);
+    if (unlink(tmpname) < 0 || link(blob, tmpname) < 0)
+        return -1;
+    if (replace(tmpname, filename) < 0) {
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef STORE_H__
+#define STORE_H__
+
+/*
+ * An optional content-addressed home for uploaded files.  Each distinct
+ * content is kept once, as a blob named by its SHA-256 in the store's
+ * objects directory, and every filename holding that content is a hard link
+ * to its blob.  Files open and serve exactly as before, but identical
+ * uploads share their disk blocks.  The hash is kept in an extended
+ * attribute of the shared inode, which makes the filesystem itself the
+ * index from names to content.
+ *
+ * The store must be on the same filesystem as the files it holds, and
+ * those files must only change through the server: writing one in place
+ * would change every name that shares its blob.
+ */
+
+/*
+ * store_open() - keep uploads in the store under dir, creating it if need
+ *                be.  Without a call to this, there is no store.
+ */
+int store_open(const char *dir);
+
+/*
+ * store_enabled() - whether there is a store
+ */
+int store_enabled(void);
+
+/*
+ * store_path() - the path of the blob with a given SHA-256, in blob, which
+ *                must hold PATH_MAX characters
+ */
+void store_path(const char *hex, char *blob);
+
+/*
+ * store_lookup() - the path of the blob a file shares its content with.
+ *                  Returns 0, or -1 if the file is not in the store.
+ */
+int store_lookup(const char *filename, char *blob);
+
+/*
+ * store_lookup_fd() - store_lookup() for a file that is already open
+ */
+int store_lookup_fd(int fd, char *blob);
+
+/*
+ * store_commit() - move a fully written temporary file with the given
+ *                  SHA-256 into place as filename.  If the store already
+ *                  has that content, filename becomes a link to the old
+ *                  blob and the new copy is thrown away.  Returns 0, or -1
+ *                  with errno set.
+ */
+int store_commit(const char *tmpname, const char *filename, const char *hex);
+
+/*
+ * store_link() - make filename hold the stored content with the given
+ *                SHA-256, by way of the unused temporary name tmpname,
+ *                without any upload.  Returns 0, or -1 with errno set to
+ *                ENOENT if the store has no such content.
+ */
+int store_link(const char *tmpname, const char *filename, const char *hex);
+
+#endif